@@ -0,0 +1,100 @@
+
+// alloc-test-style benchmark
+// each thread keeps a fixed number of slots and repeatedly replaces the
+//  block in a random slot, with sizes drawn from a distribution skewed
+//  towards small blocks (a random power of two bucket, then a random size
+//  in the bucket), so the live set stays constant while size classes
+//  and superblocks are churned
+// blocks are written to when allocated and read before they're free'd
+// usage: alloc_test [threads] [slots per thread] [ops per thread]
+//  [max size]
+// LR_PERF=1 reports hardware counters, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.h"
+#include "xorshift.h"
+
+static std::atomic<size_t> Checksum({ 0 });
+
+// picks a power of two bucket uniformly, so each bucket gets as many
+//  allocations as all smaller ones together
+static size_t RandomSize(uint64_t* rng, size_t lgMax)
+{
+    size_t lg = 3 + Rand(rng) % (lgMax - 2);
+    size_t bucket = 1ULL << lg;
+    return bucket / 2 + Rand(rng) % (bucket / 2) + 1;
+}
+
+static void Worker(size_t tid, size_t slots, size_t ops, size_t lgMax)
+{
+    uint64_t rng = (tid + 1) * 0x9e3779b97f4a7c15ULL;
+    std::vector<char*> blocks(slots, nullptr);
+    std::vector<size_t> sizes(slots, 0);
+    size_t sum = 0;
+
+    for (size_t i = 0; i < ops; ++i)
+    {
+        size_t idx = Rand(&rng) % slots;
+        if (blocks[idx])
+        {
+            sum += (unsigned char)blocks[idx][sizes[idx] - 1];
+            free(blocks[idx]);
+        }
+
+        size_t size = RandomSize(&rng, lgMax);
+        char* ptr = (char*)malloc(size);
+        ptr[0] = (char)i;
+        ptr[size - 1] = (char)i;
+        blocks[idx] = ptr;
+        sizes[idx] = size;
+    }
+
+    for (char* ptr : blocks)
+        free(ptr);
+
+    Checksum.fetch_add(sum);
+}
+
+int main(int argc, char** argv)
+{
+    size_t threads = (argc > 1) ? atol(argv[1]) : 4;
+    size_t slots = (argc > 2) ? atol(argv[2]) : 10000;
+    size_t ops = (argc > 3) ? atol(argv[3]) : 5000000;
+    size_t maxSize = (argc > 4) ? atol(argv[4]) : 4096;
+
+    size_t lgMax = 4;
+    while ((1ULL << lgMax) < maxSize)
+        ++lgMax;
+
+    PerfCounters perf;
+    PerfStart(&perf);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (size_t tid = 0; tid < threads; ++tid)
+        workers.emplace_back(Worker, tid, slots, ops, lgMax);
+
+    for (std::thread& t : workers)
+        t.join();
+
+    auto end = std::chrono::steady_clock::now();
+    PerfStop(&perf);
+    double secs = std::chrono::duration<double>(end - start).count();
+    double total = (double)threads * ops;
+
+    printf("alloc_test: threads %zu, slots %zu, ops %zu, max size %zu "
+            "(checksum %zu)\n", threads, slots, ops, (size_t)1 << lgMax,
+            Checksum.load());
+    printf("time: %.3f s, %.2f M malloc+free pairs/s\n",
+            secs, total / secs / 1e6);
+    PerfReport(&perf, "total", total);
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+
+// fragmentation benchmark
+// grows a live set of small blocks, frees most of the older half and a
+//  few of the newer half, and then keeps replacing random live blocks
+// this leaves both mostly empty and mostly full partial superblocks,
+//  the mostly empty ones can only drain if they aren't refilled
+// reports how much of the superblock memory holds live blocks,
+//  using lr_heap_walk, and where the rest of the mapped memory goes,
+//  using lr_memory_stats
+// usage: fragmentation [peak blocks] [old live %] [new live %] [churn ops]
+//  [max size]
+// LR_PERF=1 reports hardware counters per phase, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "lrmichael.h"
+#include "perf_counters.h"
+
+struct HeapStats
+{
+    size_t superblocks;
+    size_t sbBytes;
+    size_t usedBytes;
+};
+
+static void CountSuperblock(lr_sb_info const* info, void* arg)
+{
+    // large allocations aren't fragmented
+    if (info->size_class == 0)
+        return;
+
+    HeapStats* stats = (HeapStats*)arg;
+    stats->superblocks++;
+    stats->sbBytes += info->size;
+    stats->usedBytes += (info->max_count - info->free_count) * info->block_size;
+}
+
+static void Report(char const* phase)
+{
+    HeapStats stats = { 0, 0, 0 };
+    lr_heap_walk(CountSuperblock, &stats);
+
+    double used = stats.sbBytes ? (double)stats.usedBytes / stats.sbBytes : 0;
+    printf("%-8s superblocks %6zu, superblock MB %8.1f, used MB %8.1f, "
+            "utilization %5.1f%%\n",
+            phase, stats.superblocks, stats.sbBytes / 1048576.0,
+            stats.usedBytes / 1048576.0, used * 100);
+
+    lr_mem_stats mem;
+    lr_memory_stats(&mem, 1);
+    printf("%-8s mapped MB %8.1f, released MB %8.1f, active MB %8.1f, "
+            "live MB %8.1f, retained MB %8.1f, metadata MB %6.1f\n",
+            "", mem.mapped / 1048576.0, mem.released / 1048576.0,
+            mem.active / 1048576.0, mem.live / 1048576.0,
+            mem.retained / 1048576.0, mem.metadata / 1048576.0);
+}
+
+int main(int argc, char** argv)
+{
+    size_t peak = (argc > 1) ? atol(argv[1]) : 2000000;
+    size_t oldPct = (argc > 2) ? atol(argv[2]) : 5;
+    size_t newPct = (argc > 3) ? atol(argv[3]) : 80;
+    size_t ops = (argc > 4) ? atol(argv[4]) : 1000000;
+    size_t maxSize = (argc > 5) ? atol(argv[5]) : 512;
+
+    std::mt19937_64 rng(42);
+    std::vector<void*> live;
+    live.reserve(peak);
+
+    auto start = std::chrono::steady_clock::now();
+
+    PerfCounters perf;
+    PerfStart(&perf);
+    for (size_t i = 0; i < peak; ++i)
+    {
+        char* ptr = (char*)malloc(8 + rng() % maxSize);
+        ptr[0] = 1;
+        live.push_back(ptr);
+    }
+    PerfStop(&perf);
+
+    Report("grow");
+    PerfReport(&perf, "grow", peak);
+
+    // free blocks in random order, so that superblocks become partial in
+    //  random order too
+    std::vector<size_t> order(peak);
+    for (size_t i = 0; i < peak; ++i)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), rng);
+
+    std::vector<void*> kept;
+    PerfStart(&perf);
+    for (size_t i : order)
+    {
+        size_t keepPct = (i < peak / 2) ? oldPct : newPct;
+        if (rng() % 100 < keepPct)
+            kept.push_back(live[i]);
+        else
+            free(live[i]);
+    }
+    PerfStop(&perf);
+    live.swap(kept);
+
+    Report("shrink");
+    PerfReport(&perf, "shrink", peak);
+
+    // replace random live blocks
+    PerfStart(&perf);
+    for (size_t i = 0; i < ops; ++i)
+    {
+        size_t idx = rng() % live.size();
+        free(live[idx]);
+        char* ptr = (char*)malloc(8 + rng() % maxSize);
+        ptr[0] = 1;
+        live[idx] = ptr;
+    }
+    PerfStop(&perf);
+
+    Report("churn");
+    PerfReport(&perf, "churn", ops);
+
+    auto end = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(end - start).count();
+
+    printf("fragmentation: peak %zu, old live %zu%%, new live %zu%%, "
+            "ops %zu, max size %zu\n", peak, oldPct, newPct, ops, maxSize);
+    printf("time: %.3f s\n", secs);
+
+    for (void* ptr : live)
+        free(ptr);
+
+    return 0;
+}
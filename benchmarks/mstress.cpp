@@ -0,0 +1,176 @@
+
+// mstress-style stress benchmark
+// threads keep a set of live objects of mostly small, sometimes large,
+//  random sizes and replace them randomly, and hand objects to each
+//  other through a shared transfer array, so objects are often free'd
+//  by a thread other than the one that allocated them
+// every round starts new threads, so thread caches and free buffers are
+//  continuously created and flushed, while transferred objects outlive
+//  the threads that allocated them
+// objects carry a cookie that is checked before they're free'd
+// usage: mstress [threads] [scale] [rounds]
+// LR_PERF=1 reports hardware counters per iteration, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.h"
+#include "xorshift.h"
+
+#define TRANSFER_SZ 1000
+#define COOKIE 0xbf58476d1ce4e5b9ULL
+
+static std::atomic<uint64_t*> Transfer[TRANSFER_SZ];
+static std::atomic<size_t> Corrupted({ 0 });
+
+static bool Chance(uint64_t* rng, size_t pct)
+{
+    return Rand(rng) % 100 < pct;
+}
+
+// object of n words, first word is n, all words are tagged with cookie
+static uint64_t* AllocObject(size_t words)
+{
+    if (words == 0)
+        return nullptr;
+
+    uint64_t* obj = (uint64_t*)malloc(words * sizeof(uint64_t));
+    uint64_t tag = words ^ COOKIE;
+    obj[0] = words;
+    for (size_t i = 1; i < words; ++i)
+        obj[i] = tag ^ i;
+
+    return obj;
+}
+
+static void FreeObject(uint64_t* obj)
+{
+    if (!obj)
+        return;
+
+    size_t words = obj[0];
+    uint64_t tag = words ^ COOKIE;
+    for (size_t i = 1; i < words; ++i)
+    {
+        if (obj[i] != (tag ^ i))
+        {
+            Corrupted.fetch_add(1);
+            break;
+        }
+    }
+
+    free(obj);
+}
+
+// mostly small objects, 1% are up to 128x larger
+static size_t RandomWords(uint64_t* rng)
+{
+    size_t words = 1 + Rand(rng) % 16;
+    if (Chance(rng, 1))
+        words *= 1 + Rand(rng) % 128;
+
+    return words;
+}
+
+static void Stress(size_t tid, size_t round, size_t scale)
+{
+    uint64_t rng = (tid + 1) * 0x9e3779b97f4a7c15ULL + round;
+    size_t iterations = 50 * scale;
+    size_t maxLive = 100 * scale;
+
+    std::vector<uint64_t*> live;
+    live.reserve(maxLive);
+
+    // objects retained for the whole round
+    std::vector<uint64_t*> retained;
+    for (size_t i = 0; i < scale; ++i)
+        retained.push_back(AllocObject(RandomWords(&rng)));
+
+    for (size_t i = 0; i < iterations; ++i)
+    {
+        if (live.size() < maxLive && (live.empty() || Chance(&rng, 50)))
+        {
+            // allocate a few objects
+            size_t n = 1 + Rand(&rng) % 8;
+            for (size_t j = 0; j < n && live.size() < maxLive; ++j)
+                live.push_back(AllocObject(RandomWords(&rng)));
+        }
+        else if (Chance(&rng, 65))
+        {
+            // free a random object
+            size_t idx = Rand(&rng) % live.size();
+            FreeObject(live[idx]);
+            live[idx] = live.back();
+            live.pop_back();
+        }
+        else
+        {
+            // swap a random object with one in the transfer array, whatever
+            //  we get back is owned by this thread now
+            size_t idx = Rand(&rng) % live.size();
+            size_t slot = Rand(&rng) % TRANSFER_SZ;
+            uint64_t* other = Transfer[slot].exchange(live[idx]);
+            if (other)
+                live[idx] = other;
+            else
+            {
+                live[idx] = live.back();
+                live.pop_back();
+            }
+        }
+    }
+
+    for (uint64_t* obj : live)
+        FreeObject(obj);
+    for (uint64_t* obj : retained)
+        FreeObject(obj);
+}
+
+int main(int argc, char** argv)
+{
+    size_t threads = (argc > 1) ? atol(argv[1]) : 4;
+    size_t scale = (argc > 2) ? atol(argv[2]) : 100;
+    size_t rounds = (argc > 3) ? atol(argv[3]) : 50;
+
+    PerfCounters perf;
+    PerfStart(&perf);
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        std::vector<std::thread> workers;
+        for (size_t tid = 0; tid < threads; ++tid)
+            workers.emplace_back(Stress, tid, round, scale);
+
+        for (std::thread& t : workers)
+            t.join();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    PerfStop(&perf);
+    double secs = std::chrono::duration<double>(end - start).count();
+
+    for (size_t slot = 0; slot < TRANSFER_SZ; ++slot)
+        FreeObject(Transfer[slot].exchange(nullptr));
+
+    printf("mstress: threads %zu, scale %zu, rounds %zu\n",
+            threads, scale, rounds);
+    printf("time: %.3f s, %.1f thread rounds/s\n",
+            secs, threads * rounds / secs);
+    // see Stress
+    PerfReport(&perf, "total", 50.0 * scale * threads * rounds);
+
+    size_t corrupted = Corrupted.load();
+    if (corrupted)
+    {
+        printf("error: %zu corrupted objects\n", corrupted);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+
+#ifndef __PERF_COUNTERS_H
+#define __PERF_COUNTERS_H
+
+// hardware performance counters for benchmarks, using perf_event_open
+// enabled by setting LR_PERF=1 in the environment
+// counters are opened per measured phase and inherited by threads
+//  created during the phase, so they must be started before the
+//  benchmark's threads
+// counters that can't be opened (no PMU in a VM, perf_event_paranoid,
+//  seccomp) are reported as n/a, the benchmark itself is unaffected
+//
+// usage:
+//  PerfCounters perf;
+//  PerfStart(&perf);
+//  ... measured phase ...
+//  PerfStop(&perf);
+//  PerfReport(&perf, "phase", ops);
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum PerfEvent
+{
+    PERF_CYCLES         = 0,
+    PERF_INSTRUCTIONS   = 1,
+    PERF_L1D_MISSES     = 2,
+    PERF_LLC_MISSES     = 3,
+    PERF_DTLB_MISSES    = 4,
+    PERF_PAGE_FAULTS    = 5,
+    PERF_EVENTS         = 6,
+};
+
+struct PerfCounters
+{
+    int fds[PERF_EVENTS];
+    // scaled counts, valid after PerfStop
+    uint64_t values[PERF_EVENTS];
+    bool valid[PERF_EVENTS];
+    // errno of first event that couldn't be opened
+    int error;
+};
+
+static char const* PerfEventNames[PERF_EVENTS] = {
+    "cycles",
+    "instructions",
+    "L1D misses",
+    "LLC misses",
+    "dTLB misses",
+    "page faults",
+};
+
+static inline bool PerfEnabled()
+{
+    char const* env = getenv("LR_PERF");
+    return env && atoi(env) != 0;
+}
+
+static inline void PerfEventAttr(PerfEvent event, perf_event_attr* attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->disabled = 1;
+    // threads created while counting are counted as well
+    attr->inherit = 1;
+    // allowed with perf_event_paranoid <= 2
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    // counters might be multiplexed, counts are scaled by running time
+    attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    uint64_t const readMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    switch (event)
+    {
+    case PERF_CYCLES:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERF_INSTRUCTIONS:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PERF_L1D_MISSES:
+        attr->type = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_L1D | readMiss;
+        break;
+    case PERF_LLC_MISSES:
+        attr->type = PERF_TYPE_HARDWARE;
+        attr->config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case PERF_DTLB_MISSES:
+        attr->type = PERF_TYPE_HW_CACHE;
+        attr->config = PERF_COUNT_HW_CACHE_DTLB | readMiss;
+        break;
+    case PERF_PAGE_FAULTS:
+        attr->type = PERF_TYPE_SOFTWARE;
+        attr->config = PERF_COUNT_SW_PAGE_FAULTS;
+        break;
+    default:
+        break;
+    }
+}
+
+static inline void PerfStart(PerfCounters* perf)
+{
+    perf->error = 0;
+    for (int event = 0; event < PERF_EVENTS; ++event)
+    {
+        perf->fds[event] = -1;
+        perf->values[event] = 0;
+        perf->valid[event] = false;
+    }
+
+    if (!PerfEnabled())
+        return;
+
+    // counters are opened independently, so that a missing one doesn't
+    //  take the others down with it (unlike an event group)
+    for (int event = 0; event < PERF_EVENTS; ++event)
+    {
+        perf_event_attr attr;
+        PerfEventAttr((PerfEvent)event, &attr);
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd < 0 && !perf->error)
+            perf->error = errno;
+
+        perf->fds[event] = fd;
+    }
+
+    for (int event = 0; event < PERF_EVENTS; ++event)
+    {
+        if (perf->fds[event] >= 0)
+            ioctl(perf->fds[event], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static inline void PerfStop(PerfCounters* perf)
+{
+    for (int event = 0; event < PERF_EVENTS; ++event)
+    {
+        if (perf->fds[event] >= 0)
+            ioctl(perf->fds[event], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    for (int event = 0; event < PERF_EVENTS; ++event)
+    {
+        int fd = perf->fds[event];
+        if (fd < 0)
+            continue;
+
+        // value, time enabled, time running
+        uint64_t data[3];
+        if (read(fd, data, sizeof(data)) == sizeof(data) && data[2] > 0)
+        {
+            double scale = (double)data[1] / data[2];
+            perf->values[event] = (uint64_t)(data[0] * scale);
+            perf->valid[event] = true;
+        }
+
+        close(fd);
+        perf->fds[event] = -1;
+    }
+}
+
+// prints counts per op of each counter, ops is the number of operations
+//  done during the phase
+static inline void PerfReport(PerfCounters const* perf, char const* phase,
+        double ops)
+{
+    if (!PerfEnabled())
+        return;
+
+    printf("perf %s:", phase);
+    bool any = false;
+    for (int event = 0; event < PERF_EVENTS; ++event)
+    {
+        char const* sep = event ? "," : "";
+        if (!perf->valid[event])
+        {
+            printf("%s %s n/a", sep, PerfEventNames[event]);
+            continue;
+        }
+
+        any = true;
+        printf("%s %s %.3f", sep, PerfEventNames[event],
+                ops > 0 ? perf->values[event] / ops : 0.0);
+    }
+
+    printf(" per op\n");
+    if (perf->error)
+        printf("perf %s: %s counters unavailable (%s)\n", phase,
+                any ? "some" : "all", strerror(perf->error));
+}
+
+#endif // __PERF_COUNTERS_H
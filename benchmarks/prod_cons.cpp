@@ -0,0 +1,97 @@
+
+// producer-consumer benchmark
+// each producer allocates blocks and hands them to its consumer through
+//  a single-producer single-consumer ring, so every free is done by a
+//  thread other than the one that allocated the block
+// usage: prod_cons [pairs] [blocks per producer] [block size]
+// LR_PERF=1 reports hardware counters, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.h"
+
+#define RING_SZ 1024
+
+struct Ring
+{
+    std::atomic<size_t> head = { 0 };
+    char pad0[64];
+    std::atomic<size_t> tail = { 0 };
+    char pad1[64];
+    void* slots[RING_SZ];
+};
+
+static void Producer(Ring* ring, size_t blocks, size_t size)
+{
+    for (size_t i = 0; i < blocks; ++i)
+    {
+        char* ptr = (char*)malloc(size);
+        ptr[0] = (char)i;
+
+        size_t tail = ring->tail.load(std::memory_order_relaxed);
+        while (tail - ring->head.load(std::memory_order_acquire) == RING_SZ)
+            std::this_thread::yield();
+
+        ring->slots[tail % RING_SZ] = ptr;
+        ring->tail.store(tail + 1, std::memory_order_release);
+    }
+}
+
+static void Consumer(Ring* ring, size_t blocks)
+{
+    for (size_t i = 0; i < blocks; ++i)
+    {
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        while (head == ring->tail.load(std::memory_order_acquire))
+            std::this_thread::yield();
+
+        void* ptr = ring->slots[head % RING_SZ];
+        ring->head.store(head + 1, std::memory_order_release);
+        free(ptr);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t pairs = (argc > 1) ? atol(argv[1]) : 2;
+    size_t blocks = (argc > 2) ? atol(argv[2]) : 10000000;
+    size_t size = (argc > 3) ? atol(argv[3]) : 64;
+
+    std::vector<Ring*> rings;
+    for (size_t i = 0; i < pairs; ++i)
+        rings.push_back(new Ring());
+
+    PerfCounters perf;
+    PerfStart(&perf);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < pairs; ++i)
+    {
+        threads.emplace_back(Producer, rings[i], blocks, size);
+        threads.emplace_back(Consumer, rings[i], blocks);
+    }
+
+    for (std::thread& t : threads)
+        t.join();
+
+    auto end = std::chrono::steady_clock::now();
+    PerfStop(&perf);
+    double secs = std::chrono::duration<double>(end - start).count();
+    double ops = (double)pairs * blocks;
+
+    printf("prod_cons: pairs %zu, blocks %zu, size %zu\n", pairs, blocks, size);
+    printf("time: %.3f s, %.2f M malloc+free pairs/s\n", secs, ops / secs / 1e6);
+    PerfReport(&perf, "total", ops);
+
+    for (Ring* ring : rings)
+        delete ring;
+
+    return 0;
+}
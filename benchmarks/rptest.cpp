@@ -0,0 +1,173 @@
+
+// rptest-style benchmark
+// threads allocate batches of blocks with random sizes and random
+//  lifetimes (in loops), and free the blocks whose lifetime is over
+// a share of the expired blocks is handed to the next thread, which
+//  frees them, so memory continuously moves between threads
+// sizes are skewed towards small blocks, within [min size, max size]
+// reports throughput and how much memory was mapped at the end
+// usage: rptest [threads] [loops] [batch] [max lifetime] [cross %]
+//  [min size] [max size]
+// LR_PERF=1 reports hardware counters, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "lrmichael.h"
+#include "perf_counters.h"
+#include "xorshift.h"
+
+// blocks handed to a thread, linked through their first word
+struct Inbox
+{
+    std::atomic<void*> head = { nullptr };
+    char pad[64];
+};
+
+struct Params
+{
+    size_t threads;
+    size_t loops;
+    size_t batch;
+    size_t lifetime;
+    size_t crossPct;
+    size_t minSize;
+    size_t maxSize;
+};
+
+static std::vector<Inbox> Inboxes;
+
+static size_t RandomSize(uint64_t* rng, Params const& params)
+{
+    // product of two uniform draws, most blocks are small
+    size_t range = params.maxSize - params.minSize + 1;
+    uint64_t a = Rand(rng) % range;
+    uint64_t b = Rand(rng) % range;
+    return params.minSize + a * b / range;
+}
+
+static void InboxPush(Inbox* inbox, void* ptr)
+{
+    void* oldHead = inbox->head.load();
+    do
+        *(void**)ptr = oldHead;
+    while (!inbox->head.compare_exchange_weak(oldHead, ptr));
+}
+
+static size_t InboxDrain(Inbox* inbox)
+{
+    size_t count = 0;
+    void* ptr = inbox->head.exchange(nullptr);
+    while (ptr)
+    {
+        void* next = *(void**)ptr;
+        free(ptr);
+        ptr = next;
+        ++count;
+    }
+
+    return count;
+}
+
+static void Worker(size_t tid, Params params, std::atomic<size_t>* ops)
+{
+    uint64_t rng = (tid + 1) * 0x9e3779b97f4a7c15ULL;
+    Inbox* inbox = &Inboxes[tid];
+    Inbox* next = &Inboxes[(tid + 1) % params.threads];
+
+    // blocks indexed by the loop they expire in, modulo lifetime
+    std::vector<std::vector<void*>> expiring(params.lifetime);
+    size_t count = 0;
+
+    for (size_t loop = 0; loop < params.loops; ++loop)
+    {
+        for (size_t i = 0; i < params.batch; ++i)
+        {
+            size_t size = RandomSize(&rng, params);
+            char* ptr = (char*)malloc(size);
+            memset(ptr, (int)i, std::min<size_t>(size, 64));
+
+            size_t life = 1 + Rand(&rng) % params.lifetime;
+            expiring[(loop + life) % params.lifetime].push_back(ptr);
+        }
+
+        std::vector<void*>& expired = expiring[loop % params.lifetime];
+        for (void* ptr : expired)
+        {
+            if (params.threads > 1 && Rand(&rng) % 100 < params.crossPct)
+                InboxPush(next, ptr);
+            else
+                free(ptr);
+        }
+
+        InboxDrain(inbox);
+        count += params.batch;
+        expired.clear();
+    }
+
+    for (std::vector<void*>& blocks : expiring)
+    {
+        for (void* ptr : blocks)
+            free(ptr);
+    }
+
+    ops->fetch_add(count);
+}
+
+int main(int argc, char** argv)
+{
+    Params params;
+    params.threads = (argc > 1) ? atol(argv[1]) : 4;
+    params.loops = (argc > 2) ? atol(argv[2]) : 1000;
+    params.batch = (argc > 3) ? atol(argv[3]) : 2000;
+    params.lifetime = (argc > 4) ? atol(argv[4]) : 16;
+    params.crossPct = (argc > 5) ? atol(argv[5]) : 10;
+    params.minSize = (argc > 6) ? atol(argv[6]) : 16;
+    params.maxSize = (argc > 7) ? atol(argv[7]) : 8192;
+
+    // blocks are linked through their first word when handed over
+    params.minSize = std::max(params.minSize, sizeof(void*));
+    params.maxSize = std::max(params.maxSize, params.minSize);
+    params.lifetime = std::max<size_t>(params.lifetime, 1);
+
+    Inboxes = std::vector<Inbox>(params.threads);
+    std::atomic<size_t> ops({ 0 });
+
+    PerfCounters perf;
+    PerfStart(&perf);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (size_t tid = 0; tid < params.threads; ++tid)
+        workers.emplace_back(Worker, tid, params, &ops);
+
+    for (std::thread& t : workers)
+        t.join();
+
+    auto end = std::chrono::steady_clock::now();
+    PerfStop(&perf);
+    double secs = std::chrono::duration<double>(end - start).count();
+
+    // blocks handed over after the receiver's last drain
+    for (Inbox& inbox : Inboxes)
+        InboxDrain(&inbox);
+
+    lr_mem_stats mem;
+    lr_memory_stats(&mem, 0);
+
+    printf("rptest: threads %zu, loops %zu, batch %zu, lifetime %zu, "
+            "cross %zu%%, sizes %zu-%zu\n", params.threads, params.loops,
+            params.batch, params.lifetime, params.crossPct, params.minSize,
+            params.maxSize);
+    printf("time: %.3f s, %.2f M malloc+free pairs/s, mapped MB %.1f, "
+            "retained MB %.1f\n", secs, ops.load() / secs / 1e6,
+            mem.mapped / 1048576.0, mem.retained / 1048576.0);
+    PerfReport(&perf, "total", ops.load());
+
+    return 0;
+}
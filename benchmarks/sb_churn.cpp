@@ -0,0 +1,139 @@
+
+// superblock churn benchmark, measures the paths that are dominated by
+//  atomic operations rather than by the thread cache
+// churn: each round allocates a superblock worth of blocks, frees them and
+//  flushes the thread cache, so superblocks keep going through
+//  MallocFromNewSB (descriptor alloc, pagemap registration of every page,
+//  active CAS) and back to the pool (anchor CAS, unregistration,
+//  descriptor retire)
+// partial: each round frees every other block of a superblock worth of
+//  live blocks and allocates them again, so superblocks keep going
+//  through the partial lists (FULL->PARTIAL push, MallocFromPartial pop,
+//  UpdateActive)
+// compare a default build with one where every atomic is seq_cst:
+//  make clean && make bench && ./benchmarks/sb_churn
+//  make clean && make bench CPPFLAGS=-DLFMALLOC_SEQ_CST=1 && ./benchmarks/sb_churn
+// without arguments, sweeps thread counts
+// usage: sb_churn [threads] [rounds] [block size]
+// LR_PERF=1 reports hardware counters, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "lrmichael.h"
+#include "perf_counters.h"
+
+enum Phase
+{
+    PHASE_CHURN     = 0,
+    PHASE_PARTIAL   = 1,
+    PHASE_COUNT     = 2,
+};
+
+static char const* PhaseNames[PHASE_COUNT] = { "churn", "partial" };
+
+static void Churn(size_t rounds, size_t size, size_t count)
+{
+    std::vector<char*> blocks(count);
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        for (char*& ptr : blocks)
+        {
+            ptr = (char*)malloc(size);
+            ptr[0] = 1;
+        }
+
+        for (char* ptr : blocks)
+            free(ptr);
+
+        lr_thread_cache_flush();
+    }
+}
+
+static void Partial(size_t rounds, size_t size, size_t count)
+{
+    std::vector<char*> blocks(count);
+    for (char*& ptr : blocks)
+    {
+        ptr = (char*)malloc(size);
+        ptr[0] = 1;
+    }
+
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        // alternate halves, so every superblock loses blocks each round
+        for (size_t idx = round % 2; idx < count; idx += 2)
+            free(blocks[idx]);
+
+        lr_thread_cache_flush();
+
+        for (size_t idx = round % 2; idx < count; idx += 2)
+        {
+            blocks[idx] = (char*)malloc(size);
+            blocks[idx][0] = 1;
+        }
+    }
+
+    for (char* ptr : blocks)
+        free(ptr);
+}
+
+static void Run(Phase phase, size_t threads, size_t rounds, size_t size)
+{
+    size_t count = SB_SZ / size;
+
+    PerfCounters perf;
+    PerfStart(&perf);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> workers;
+    for (size_t tid = 0; tid < threads; ++tid)
+    {
+        if (phase == PHASE_CHURN)
+            workers.emplace_back(Churn, rounds, size, count);
+        else
+            workers.emplace_back(Partial, rounds, size, count);
+    }
+
+    for (std::thread& t : workers)
+        t.join();
+
+    auto end = std::chrono::steady_clock::now();
+    PerfStop(&perf);
+
+    // malloc + free per block
+    double ops = 2.0 * threads * rounds *
+        ((phase == PHASE_CHURN) ? count : count / 2);
+    double secs = std::chrono::duration<double>(end - start).count();
+    printf("sb_churn: %-7s threads %zu, size %zu, rounds %zu, "
+            "%.3f s, %.2f ns/op, %.0f rounds/s\n", PhaseNames[phase],
+            threads, size, rounds, secs, secs * 1e9 / ops,
+            threads * rounds / secs);
+    PerfReport(&perf, PhaseNames[phase], ops);
+}
+
+int main(int argc, char** argv)
+{
+    size_t threads = (argc > 1) ? atol(argv[1]) : 0;
+    size_t rounds = (argc > 2) ? atol(argv[2]) : 3000;
+    size_t size = (argc > 3) ? atol(argv[3]) : 8192;
+    size = std::max<size_t>(size, 1);
+
+    printf("orderings: %s\n", LFMALLOC_SEQ_CST ? "seq_cst" : "explicit");
+
+    std::vector<size_t> sweep = { 1, 2, 4 };
+    if (threads)
+        sweep = { threads };
+
+    for (size_t t : sweep)
+    {
+        for (int phase = 0; phase < PHASE_COUNT; ++phase)
+            Run((Phase)phase, t, rounds, size);
+    }
+
+    return 0;
+}
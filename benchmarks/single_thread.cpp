@@ -0,0 +1,153 @@
+
+// single threaded mode benchmark
+// runs each workload in the main thread while the process is single
+//  threaded, then creates (and joins) a thread and runs it again, so with
+//  a library built with LFMALLOC_SINGLE_THREAD=1 the first run uses plain
+//  loads and stores and the second one atomics
+// workloads:
+// - cache: random small sizes with a live set, mostly thread cache hits,
+//  refills and flushes go to the superblocks
+// - arena: arena blocks aren't cached, every malloc/free does an anchor CAS
+// - churn: superblocks are allocated and released, see sb_churn
+// compare:
+//  make clean && make bench CPPFLAGS=-DLFMALLOC_SINGLE_THREAD=1
+// usage: single_thread [ops] [live blocks]
+// LR_PERF=1 reports hardware counters, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "lrmichael.h"
+#include "single_thread.h"
+#include "perf_counters.h"
+#include "xorshift.h"
+
+#define CHURN_SZ 8192
+
+enum Workload
+{
+    WORKLOAD_CACHE  = 0,
+    WORKLOAD_ARENA  = 1,
+    WORKLOAD_CHURN  = 2,
+    WORKLOAD_COUNT  = 3,
+};
+
+static char const* WorkloadNames[WORKLOAD_COUNT] =
+    { "cache", "arena", "churn" };
+
+// replaces random blocks of the live set, returns malloc+free count
+static size_t Replace(lr_arena* arena, size_t ops, size_t live)
+{
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    std::vector<char*> blocks(live, nullptr);
+    for (size_t i = 0; i < ops; ++i)
+    {
+        size_t idx = Rand(&rng) % live;
+        size_t size = 16 + Rand(&rng) % 1009;
+        free(blocks[idx]);
+        char* ptr = arena ?
+            (char*)lr_arena_malloc(arena, size) : (char*)malloc(size);
+        ptr[0] = 1;
+        blocks[idx] = ptr;
+    }
+
+    for (char* ptr : blocks)
+        free(ptr);
+
+    return 2 * ops;
+}
+
+static size_t Churn(size_t ops)
+{
+    size_t count = SB_SZ / CHURN_SZ;
+    size_t rounds = std::max<size_t>(ops / count, 1);
+    std::vector<char*> blocks(count);
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        for (char*& ptr : blocks)
+        {
+            ptr = (char*)malloc(CHURN_SZ);
+            ptr[0] = 1;
+        }
+
+        for (char* ptr : blocks)
+            free(ptr);
+
+        lr_thread_cache_flush();
+    }
+
+    return 2 * rounds * count;
+}
+
+// returns malloc+free count
+static size_t Work(Workload workload, lr_arena* arena, size_t ops,
+        size_t live)
+{
+    switch (workload)
+    {
+    case WORKLOAD_CACHE:
+        return Replace(nullptr, ops, live);
+    case WORKLOAD_ARENA:
+        return Replace(arena, ops, live);
+    default:
+        return Churn(ops);
+    }
+}
+
+// returns ns per op
+static double Run(Workload workload, lr_arena* arena, size_t ops,
+        size_t live, char const* mode)
+{
+    PerfCounters perf;
+    PerfStart(&perf);
+    auto start = std::chrono::steady_clock::now();
+
+    size_t done = Work(workload, arena, ops, live);
+
+    auto end = std::chrono::steady_clock::now();
+    PerfStop(&perf);
+
+    double secs = std::chrono::duration<double>(end - start).count();
+    char phase[64];
+    snprintf(phase, sizeof(phase), "%s %s", WorkloadNames[workload], mode);
+    PerfReport(&perf, phase, done);
+    return secs * 1e9 / done;
+}
+
+int main(int argc, char** argv)
+{
+    size_t ops = (argc > 1) ? atol(argv[1]) : 20000000;
+    size_t live = (argc > 2) ? atol(argv[2]) : 10000;
+    live = std::max<size_t>(live, 1);
+
+    printf("single threaded mode: %s\n",
+            LFMALLOC_SINGLE_THREAD ? "enabled" : "disabled");
+
+    // created up front, so that both runs use an existing arena
+    lr_arena* arena = lr_arena_create();
+
+    // both runs start with memory mapped and the thread cache warm
+    for (int workload = 0; workload < WORKLOAD_COUNT; ++workload)
+        Work((Workload)workload, arena, ops / 4, live);
+
+    double single[WORKLOAD_COUNT];
+    for (int workload = 0; workload < WORKLOAD_COUNT; ++workload)
+        single[workload] = Run((Workload)workload, arena, ops, live, "single");
+
+    // process stays multi threaded after the thread exits
+    std::thread([]() { }).join();
+
+    for (int workload = 0; workload < WORKLOAD_COUNT; ++workload)
+    {
+        double multi = Run((Workload)workload, arena, ops, live, "multi");
+        printf("single_thread: %-5s single %6.2f ns/op, multi %6.2f ns/op, "
+                "%.2fx\n", WorkloadNames[workload], single[workload], multi,
+                multi / single[workload]);
+    }
+
+    return 0;
+}
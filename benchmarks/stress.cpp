@@ -0,0 +1,467 @@
+
+// stress test of the lock-free protocol, doubles as a high contention
+//  benchmark
+// threads allocate from a few shared size classes through all paths:
+//  malloc (thread cache, batch refills), lr_malloc_batch, an arena
+//  (MallocFromActive/MallocFromPartial/MallocFromNewSB without a cache)
+//  and occasional large allocations, free in random order and hand
+//  blocks to each other, so frees race with allocations on the same
+//  superblocks and descriptors are retired and reused
+// every block is tagged with its owner when allocated, and the tag is
+//  checked before it's free'd, so a block handed out twice is detected
+//  while both owners hold it (or after the other owner free'd it)
+// after each round, with all threads stopped, the heap is walked to check
+//  that counts are consistent with maxcount, that every block held by
+//  the test is allocated, that every allocated block of the test's size
+//  classes is held (or was allocated by the main thread before the
+//  rounds), and that no superblock is stuck in SB_ACTIVE without being
+//  a heap's active superblock
+// before the rounds, short lived threads allocate and free blocks, to
+//  check that thread exit returns their cached and buffered blocks
+// build the library with random yields in the protocol and asserts:
+//  make clean && make bench CPPFLAGS="-DLFMALLOC_STRESS=1 -DLFMALLOC_SANITY=1"
+// usage: stress [threads] [rounds] [ops per thread per round]
+//  [live blocks per thread]
+// LR_PERF=1 reports hardware counters, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "lrmichael.h"
+#include "perf_counters.h"
+#include "xorshift.h"
+
+#define TRANSFER_SZ 256
+#define BATCH_MAX 16
+#define LARGE_SZ (64 << 10)
+#define EXIT_THREADS 16
+#define EXIT_BLOCKS 64
+
+#define TAG_MAGIC 0x5bd1e9955bd1e995ULL
+
+// first words of every block
+struct Block
+{
+    // owner thread, size and sequence number
+    uint64_t tag;
+    // tag ^ TAG_MAGIC, detects a link written by a free
+    uint64_t check;
+};
+
+// sizes are few and shared by all threads, to maximize contention
+static size_t const Sizes[] = { 16, 32, 48, 64, 96, 256, 1000, 3000 };
+#define SIZES_COUNT (sizeof(Sizes) / sizeof(Sizes[0]))
+
+// block size of the size class of each of Sizes
+static size_t SizeBlocks[SIZES_COUNT];
+// blocks of those size classes the main thread allocated for itself
+//  (thread states, vectors) before the rounds
+static size_t MainBlocks[SIZES_COUNT];
+
+static std::atomic<Block*> Transfer[TRANSFER_SZ];
+static std::atomic<size_t> Errors({ 0 });
+static lr_arena* Arena = nullptr;
+
+struct ThreadState
+{
+    std::vector<Block*> live;
+    uint64_t rng;
+    uint64_t seq;
+    uint64_t ops;
+};
+
+static void Error(char const* what, void* ptr)
+{
+    if (Errors.fetch_add(1) < 10)
+        fprintf(stderr, "error: %s, block %p\n", what, ptr);
+}
+
+static void Tag(ThreadState* state, size_t tid, Block* block, size_t size)
+{
+    uint64_t tag = ((uint64_t)tid << 56) | ((uint64_t)size << 32) |
+        (state->seq++ & 0xffffffff);
+    block->tag = tag;
+    block->check = tag ^ TAG_MAGIC;
+}
+
+static size_t BlockSize(Block const* block)
+{
+    return (block->tag >> 32) & 0xffffff;
+}
+
+// size is part of the tag, so blocks can be verified by any thread
+static bool Verify(Block const* block)
+{
+    size_t size = BlockSize(block);
+    return (block->tag ^ block->check) == TAG_MAGIC &&
+        size >= sizeof(Block) && size <= LARGE_SZ;
+}
+
+static size_t RandomSize(ThreadState* state)
+{
+    if (Rand(&state->rng) % 1000 == 0)
+        return LARGE_SZ;
+
+    return Sizes[Rand(&state->rng) % SIZES_COUNT];
+}
+
+// fills the empty slot idx, and possibly a few more, with new blocks
+static void AllocateInto(ThreadState* state, size_t tid, size_t idx)
+{
+    size_t size = RandomSize(state);
+    uint64_t r = Rand(&state->rng) % 8;
+    if (r == 0 && size != LARGE_SZ)
+    {
+        // batch into empty slots after idx
+        void* blocks[BATCH_MAX];
+        size_t n = 1 + Rand(&state->rng) % BATCH_MAX;
+        size_t slots = 0;
+        size_t slotIdx[BATCH_MAX];
+        for (size_t i = idx; i < state->live.size() && slots < n; ++i)
+        {
+            if (!state->live[i])
+                slotIdx[slots++] = i;
+        }
+
+        size_t count = lr_malloc_batch(size, slots, blocks);
+        for (size_t i = 0; i < count; ++i)
+        {
+            Block* block = (Block*)blocks[i];
+            Tag(state, tid, block, size);
+            state->live[slotIdx[i]] = block;
+        }
+
+        return;
+    }
+
+    Block* block = (r == 1) ?
+        (Block*)lr_arena_malloc(Arena, size) : (Block*)malloc(size);
+    Tag(state, tid, block, size);
+    state->live[idx] = block;
+}
+
+static void FreeSlot(ThreadState* state, size_t idx)
+{
+    Block* block = state->live[idx];
+    if (!Verify(block))
+        Error("block handed out twice or corrupted", block);
+
+    // arena blocks are free'd like any other block
+    free(block);
+    state->live[idx] = nullptr;
+}
+
+static void Worker(size_t tid, ThreadState* state, size_t ops)
+{
+    size_t const live = state->live.size();
+    for (size_t i = 0; i < ops; ++i)
+    {
+        size_t idx = Rand(&state->rng) % live;
+        uint64_t r = Rand(&state->rng) % 16;
+        if (!state->live[idx])
+            AllocateInto(state, tid, idx);
+        else if (r < 12)
+            FreeSlot(state, idx);
+        else
+        {
+            // swap with a transfer slot
+            Block* block = state->live[idx];
+            if (!Verify(block))
+                Error("block handed out twice or corrupted", block);
+
+            size_t slot = Rand(&state->rng) % TRANSFER_SZ;
+            state->live[idx] = Transfer[slot].exchange(block);
+        }
+    }
+
+    state->ops += ops;
+}
+
+struct HeapCheck
+{
+    // allocated blocks, from lr_heap_walk_blocks
+    std::vector<void*> blocks;
+    // superblocks in SB_ACTIVE, by size class
+    size_t active[256];
+    // allocated blocks of the test's size classes, by Sizes index
+    size_t allocated[SIZES_COUNT];
+};
+
+// returns the Sizes index of the size class with blockSize, or
+//  SIZES_COUNT if it isn't one of the test's
+static size_t SizeIdx(size_t blockSize)
+{
+    size_t idx = 0;
+    while (idx < SIZES_COUNT && SizeBlocks[idx] != blockSize)
+        ++idx;
+
+    return idx;
+}
+
+static void CollectBlock(void* block, size_t, void* arg)
+{
+    HeapCheck* check = (HeapCheck*)arg;
+    check->blocks.push_back(block);
+}
+
+static void CheckSuperblock(lr_sb_info const* info, void* arg)
+{
+    HeapCheck* check = (HeapCheck*)arg;
+
+    // SB_ACTIVE
+    if (info->state == 0 && info->size_class < 256)
+        check->active[info->size_class]++;
+
+    if (info->free_count > info->max_count)
+        Error("superblock free count larger than max count", info->start);
+
+    size_t allocated = lr_heap_walk_blocks(info, CollectBlock, arg);
+    if (allocated != info->max_count - info->free_count)
+        Error("allocated blocks inconsistent with anchor count",
+                info->start);
+
+    // arena and global heap blocks of a size class are counted together
+    size_t sizeIdx = SizeIdx(info->block_size);
+    if (info->size_class != 0 && sizeIdx < SIZES_COUNT)
+        check->allocated[sizeIdx] += allocated;
+}
+
+// blocks cached or buffered by the calling thread are flushed by the
+//  walk, exited threads must have returned theirs
+static void WalkHeap(HeapCheck* check)
+{
+    memset(check->active, 0, sizeof(check->active));
+    memset(check->allocated, 0, sizeof(check->allocated));
+    // walk must not allocate from the heap it walks
+    check->blocks.reserve(1 << 20);
+    lr_heap_walk(CheckSuperblock, check);
+    std::sort(check->blocks.begin(), check->blocks.end());
+}
+
+// must be called while worker threads are stopped
+static void CheckHeap(std::vector<ThreadState*> const& states)
+{
+    HeapCheck check;
+    WalkHeap(&check);
+
+    std::vector<void*> held;
+    for (ThreadState* state : states)
+    {
+        for (size_t idx = 0; idx < state->live.size(); ++idx)
+        {
+            Block* block = state->live[idx];
+            if (!block)
+                continue;
+
+            if (!Verify(block))
+                Error("held block corrupted", block);
+
+            held.push_back(block);
+        }
+    }
+
+    for (size_t slot = 0; slot < TRANSFER_SZ; ++slot)
+    {
+        if (Block* block = Transfer[slot].load())
+            held.push_back(block);
+    }
+
+    for (void* block : held)
+    {
+        if (!std::binary_search(check.blocks.begin(), check.blocks.end(),
+                    block))
+            Error("held block not allocated", block);
+    }
+
+    std::sort(held.begin(), held.end());
+    if (std::adjacent_find(held.begin(), held.end()) != held.end())
+        Error("block held twice", nullptr);
+
+    // an allocated block that nobody holds was lost, e.g left in the
+    //  cache or free buffer of an exited thread
+    size_t heldCount[SIZES_COUNT] = { };
+    for (void* block : held)
+    {
+        size_t sizeIdx = SizeIdx(lr_malloc_usable_size(block));
+        if (sizeIdx < SIZES_COUNT)
+            heldCount[sizeIdx]++;
+    }
+
+    for (size_t sizeIdx = 0; sizeIdx < SIZES_COUNT; ++sizeIdx)
+    {
+        size_t expected = MainBlocks[sizeIdx] + heldCount[sizeIdx];
+        if (check.allocated[sizeIdx] != expected)
+        {
+            fprintf(stderr, "error: %zu byte blocks, %zu allocated, %zu "
+                    "held\n", SizeBlocks[sizeIdx], check.allocated[sizeIdx],
+                    expected);
+            Errors.fetch_add(1);
+        }
+    }
+
+    // superblocks left in SB_ACTIVE must be installed in a heap, there's
+    //  one heap per size class in the global heaps and in the arena
+    for (size_t sizeClass = 1; sizeClass < 256; ++sizeClass)
+    {
+        if (check.active[sizeClass] > 2)
+            Error("superblocks stuck in SB_ACTIVE", nullptr);
+    }
+}
+
+static void CountAllocated(lr_sb_info const* info, void* arg)
+{
+    // large allocations aren't cached or buffered
+    if (info->size_class != 0)
+        *(size_t*)arg += info->max_count - info->free_count;
+}
+
+// allocated small blocks, the calling thread's cache and buffers are
+//  flushed by lr_heap_walk
+static size_t AllocatedBlocks()
+{
+    size_t count = 0;
+    lr_heap_walk(CountAllocated, &count);
+    return count;
+}
+
+static void AllocateAndExit()
+{
+    void* blocks[EXIT_BLOCKS];
+    for (size_t size : Sizes)
+    {
+        for (void*& ptr : blocks)
+            ptr = malloc(size);
+
+        for (void* ptr : blocks)
+            free(ptr);
+    }
+}
+
+// threads free everything they allocated, so once they exited, their
+//  thread caches and free buffers must have been returned, whatever the
+//  order the key destructors run in
+static void CheckThreadExit()
+{
+    // the first thread creation allocates (libc/libstdc++ state that's
+    //  kept for the rest of the process), it's not counted
+    std::thread(AllocateAndExit).join();
+    size_t before = AllocatedBlocks();
+    for (size_t i = 0; i < EXIT_THREADS; ++i)
+        std::thread(AllocateAndExit).join();
+
+    size_t after = AllocatedBlocks();
+    if (after > before)
+    {
+        fprintf(stderr, "error: %zu blocks left allocated by %d exited "
+                "threads\n", after - before, EXIT_THREADS);
+        Errors.fetch_add(1);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t threads = (argc > 1) ? atol(argv[1]) : 8;
+    size_t rounds = (argc > 2) ? atol(argv[2]) : 20;
+    size_t ops = (argc > 3) ? atol(argv[3]) : 200000;
+    size_t live = (argc > 4) ? atol(argv[4]) : 1000;
+    live = std::max<size_t>(live, BATCH_MAX);
+
+    Arena = lr_arena_create();
+
+    CheckThreadExit();
+
+    std::vector<ThreadState*> states;
+    for (size_t tid = 0; tid < threads; ++tid)
+    {
+        ThreadState* state = new ThreadState();
+        state->live.assign(live, nullptr);
+        state->rng = (tid + 1) * 0x9e3779b97f4a7c15ULL;
+        state->seq = 0;
+        state->ops = 0;
+        states.push_back(state);
+    }
+
+    // main thread's own blocks must stay the same during the rounds
+    std::vector<std::thread> workers;
+    workers.reserve(threads);
+
+    for (size_t sizeIdx = 0; sizeIdx < SIZES_COUNT; ++sizeIdx)
+    {
+        void* ptr = malloc(Sizes[sizeIdx]);
+        SizeBlocks[sizeIdx] = lr_malloc_usable_size(ptr);
+        free(ptr);
+    }
+
+    {
+        HeapCheck check;
+        WalkHeap(&check);
+        memcpy(MainBlocks, check.allocated, sizeof(MainBlocks));
+    }
+
+    PerfCounters perf;
+    PerfStart(&perf);
+    double secs = 0;
+    for (size_t round = 0; round < rounds; ++round)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        // new threads every round, so thread caches and free buffers are
+        //  flushed on exit while other threads keep their blocks
+        for (size_t tid = 0; tid < threads; ++tid)
+            workers.emplace_back(Worker, tid, states[tid], ops);
+
+        for (std::thread& t : workers)
+            t.join();
+
+        workers.clear();
+
+        auto end = std::chrono::steady_clock::now();
+        secs += std::chrono::duration<double>(end - start).count();
+
+        CheckHeap(states);
+    }
+
+    PerfStop(&perf);
+
+    size_t total = 0;
+    for (ThreadState* state : states)
+    {
+        total += state->ops;
+        for (size_t idx = 0; idx < live; ++idx)
+        {
+            if (state->live[idx])
+                FreeSlot(state, idx);
+        }
+
+        delete state;
+    }
+
+    for (size_t slot = 0; slot < TRANSFER_SZ; ++slot)
+    {
+        Block* block = Transfer[slot].exchange(nullptr);
+        if (block && !Verify(block))
+            Error("transferred block corrupted", block);
+        free(block);
+    }
+
+    printf("stress: threads %zu, rounds %zu, ops %zu, live %zu\n",
+            threads, rounds, ops, live);
+    printf("time: %.3f s, %.2f M ops/s\n", secs, total / secs / 1e6);
+    PerfReport(&perf, "total", total);
+
+    size_t errors = Errors.load();
+    if (errors)
+    {
+        printf("FAILED: %zu errors\n", errors);
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,282 @@
+
+// open-loop tail latency benchmark
+// each worker replaces blocks in a set of live blocks (free + malloc) at
+//  a fixed target rate: operation i is scheduled at start + i * interval,
+//  whether or not the previous operations were on time
+// latency is measured from the scheduled time, so a stall also counts
+//  for every operation that queued up behind it (no coordinated
+//  omission), service time is measured from the actual start
+// latencies go to log-linear (HDR-style) histograms, merged over threads
+// without arguments, sweeps thread counts and size mixes
+// usage: tail_latency [threads] [size mix] [ops/s per thread] [seconds]
+//  [live blocks per thread]
+// size mixes: small (8-256), medium (8-64K), large (medium, 1% 64K-1M)
+// LR_PERF=1 reports hardware counters, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "perf_counters.h"
+#include "xorshift.h"
+
+// values are recorded with 1/SUB_BUCKETS relative precision
+#define LG_SUB_BUCKETS 6
+#define SUB_BUCKETS (1ULL << LG_SUB_BUCKETS)
+#define EXP_BUCKETS (64 - LG_SUB_BUCKETS)
+
+// log-linear histogram of ns values
+// values < SUB_BUCKETS are exact, larger values are bucketed by their
+//  highest bit and the LG_SUB_BUCKETS bits below it
+struct Histogram
+{
+    uint64_t counts[EXP_BUCKETS + 1][SUB_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+
+    Histogram() { memset(this, 0, sizeof(*this)); }
+
+    void Record(uint64_t value)
+    {
+        size_t exp = 0;
+        if (value >= SUB_BUCKETS)
+            exp = 64 - __builtin_clzll(value) - LG_SUB_BUCKETS;
+
+        counts[exp][(value >> (exp ? exp - 1 : 0)) & (SUB_BUCKETS - 1)]++;
+        total++;
+        max = std::max(max, value);
+    }
+
+    void Merge(Histogram const& other)
+    {
+        for (size_t exp = 0; exp <= EXP_BUCKETS; ++exp)
+        {
+            for (size_t sub = 0; sub < SUB_BUCKETS; ++sub)
+                counts[exp][sub] += other.counts[exp][sub];
+        }
+
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+
+    // highest value of bucket holding the pct percentile
+    uint64_t Percentile(double pct) const
+    {
+        uint64_t rank = (uint64_t)(total * pct / 100.0);
+        uint64_t seen = 0;
+        for (size_t exp = 0; exp <= EXP_BUCKETS; ++exp)
+        {
+            for (size_t sub = 0; sub < SUB_BUCKETS; ++sub)
+            {
+                seen += counts[exp][sub];
+                if (seen > rank)
+                    return std::min(BucketMax(exp, sub), max);
+            }
+        }
+
+        return max;
+    }
+
+    static uint64_t BucketMax(size_t exp, size_t sub)
+    {
+        if (exp == 0)
+            return sub;
+
+        // sub has the highest bit cleared, see Record
+        uint64_t base = (SUB_BUCKETS | sub) << (exp - 1);
+        return base + (1ULL << (exp - 1)) - 1;
+    }
+};
+
+enum SizeMix
+{
+    MIX_SMALL   = 0,
+    MIX_MEDIUM  = 1,
+    MIX_LARGE   = 2,
+    MIX_COUNT   = 3,
+};
+
+static char const* MixNames[MIX_COUNT] = { "small", "medium", "large" };
+
+struct Params
+{
+    size_t threads;
+    SizeMix mix;
+    size_t rate;
+    double seconds;
+    size_t live;
+};
+
+struct WorkerResult
+{
+    Histogram latency;
+    Histogram service;
+    // operations that started more than an interval late
+    uint64_t late;
+
+    WorkerResult() : late(0) { }
+};
+
+static size_t RandomSize(uint64_t* rng, SizeMix mix)
+{
+    switch (mix)
+    {
+    case MIX_SMALL:
+        return 8 + Rand(rng) % 249;
+    case MIX_LARGE:
+        if (Rand(rng) % 100 == 0)
+            return (64 << 10) + Rand(rng) % (960 << 10);
+        // fall through
+    default:
+        // uniform power of two bucket, then uniform within bucket
+        size_t lg = 3 + Rand(rng) % 13;
+        return (1ULL << lg) + Rand(rng) % (1ULL << lg);
+    }
+}
+
+static uint64_t NowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void Worker(size_t tid, Params params, uint64_t start,
+        WorkerResult* result)
+{
+    uint64_t rng = (tid + 1) * 0x9e3779b97f4a7c15ULL;
+    std::vector<char*> blocks(params.live);
+    for (char*& ptr : blocks)
+    {
+        ptr = (char*)malloc(RandomSize(&rng, params.mix));
+        ptr[0] = 1;
+    }
+
+    uint64_t interval = 1000000000ULL / params.rate;
+    uint64_t ops = (uint64_t)(params.seconds * params.rate);
+    for (uint64_t i = 0; i < ops; ++i)
+    {
+        uint64_t scheduled = start + i * interval;
+        uint64_t now = NowNs();
+        while (now < scheduled)
+        {
+            // other workers might need the cpu, returns immediately if
+            //  there's nothing else to run
+            std::this_thread::yield();
+            now = NowNs();
+        }
+
+        if (now > scheduled + interval)
+            result->late++;
+
+        size_t idx = Rand(&rng) % params.live;
+        size_t size = RandomSize(&rng, params.mix);
+        free(blocks[idx]);
+        char* ptr = (char*)malloc(size);
+        ptr[0] = 1;
+        blocks[idx] = ptr;
+
+        uint64_t end = NowNs();
+        result->latency.Record(end - scheduled);
+        result->service.Record(end - now);
+    }
+
+    for (char* ptr : blocks)
+        free(ptr);
+}
+
+static void Report(char const* name, Histogram const& hist)
+{
+    printf("  %-8s p50 %8.2f us, p99 %8.2f us, p99.9 %8.2f us, "
+            "p99.99 %8.2f us, max %9.2f us\n", name,
+            hist.Percentile(50) / 1e3, hist.Percentile(99) / 1e3,
+            hist.Percentile(99.9) / 1e3, hist.Percentile(99.99) / 1e3,
+            hist.max / 1e3);
+}
+
+static void Run(Params params)
+{
+    std::vector<WorkerResult*> results;
+    for (size_t tid = 0; tid < params.threads; ++tid)
+        results.push_back(new WorkerResult());
+
+    PerfCounters perf;
+    PerfStart(&perf);
+
+    // leave time for the workers to fill their live sets
+    uint64_t start = NowNs() + 100000000ULL;
+    std::vector<std::thread> workers;
+    for (size_t tid = 0; tid < params.threads; ++tid)
+        workers.emplace_back(Worker, tid, params, start, results[tid]);
+
+    for (std::thread& t : workers)
+        t.join();
+
+    PerfStop(&perf);
+
+    WorkerResult total;
+    for (WorkerResult* result : results)
+    {
+        total.latency.Merge(result->latency);
+        total.service.Merge(result->service);
+        total.late += result->late;
+        delete result;
+    }
+
+    printf("tail_latency: threads %zu, mix %s, rate %zu ops/s per thread, "
+            "ops %zu, late %.2f%%\n", params.threads, MixNames[params.mix],
+            params.rate, (size_t)total.latency.total,
+            100.0 * total.late / std::max<uint64_t>(total.latency.total, 1));
+    Report("latency", total.latency);
+    Report("service", total.service);
+    PerfReport(&perf, "total", total.latency.total);
+}
+
+static SizeMix ParseMix(char const* name)
+{
+    for (int mix = 0; mix < MIX_COUNT; ++mix)
+    {
+        if (strcmp(name, MixNames[mix]) == 0)
+            return (SizeMix)mix;
+    }
+
+    fprintf(stderr, "unknown size mix %s, using small\n", name);
+    return MIX_SMALL;
+}
+
+int main(int argc, char** argv)
+{
+    Params params;
+    params.threads = (argc > 1) ? atol(argv[1]) : 0;
+    params.mix = (argc > 2) ? ParseMix(argv[2]) : MIX_SMALL;
+    params.rate = (argc > 3) ? atol(argv[3]) : 50000;
+    params.seconds = (argc > 4) ? atof(argv[4]) : 1.0;
+    params.live = (argc > 5) ? atol(argv[5]) : 10000;
+
+    params.rate = std::max<size_t>(params.rate, 1);
+    params.live = std::max<size_t>(params.live, 1);
+
+    if (params.threads)
+    {
+        Run(params);
+        return 0;
+    }
+
+    // sweep
+    size_t threads[] = { 1, 2, 4 };
+    for (size_t t : threads)
+    {
+        for (int mix = 0; mix < MIX_COUNT; ++mix)
+        {
+            params.threads = t;
+            params.mix = (SizeMix)mix;
+            Run(params);
+        }
+    }
+
+    return 0;
+}
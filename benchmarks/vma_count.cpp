@@ -0,0 +1,93 @@
+
+// mapping (VMA) count benchmark
+// allocates blocks of random sizes and frees most of them in each round,
+//  keeping a few alive, so that superblocks are continuously created and
+//  released while others stay around
+// reports number of mappings in /proc/self/maps
+// usage: vma_count [rounds] [blocks per round] [max size]
+// LR_PERF=1 reports hardware counters, see perf_counters.h
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "perf_counters.h"
+
+static size_t CountMappings()
+{
+    FILE* f = fopen("/proc/self/maps", "r");
+    if (!f)
+        return 0;
+
+    size_t count = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f))
+    {
+        // lines can be longer than buffer
+        if (strchr(line, '\n'))
+            ++count;
+    }
+
+    fclose(f);
+    return count;
+}
+
+int main(int argc, char** argv)
+{
+    size_t rounds = (argc > 1) ? atol(argv[1]) : 20;
+    size_t blocks = (argc > 2) ? atol(argv[2]) : 200000;
+    size_t maxSize = (argc > 3) ? atol(argv[3]) : 16384;
+
+    std::mt19937_64 rng(42);
+    std::vector<void*> live;
+    std::vector<void*> round;
+    round.reserve(blocks);
+
+    size_t initial = CountMappings();
+    size_t peak = initial;
+
+    PerfCounters perf;
+    PerfStart(&perf);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; ++r)
+    {
+        for (size_t i = 0; i < blocks; ++i)
+        {
+            size_t size = 8 + rng() % maxSize;
+            char* ptr = (char*)malloc(size);
+            ptr[0] = 1;
+            round.push_back(ptr);
+        }
+
+        // keep ~1% alive, pinning their superblocks
+        for (void* ptr : round)
+        {
+            if (rng() % 100 == 0)
+                live.push_back(ptr);
+            else
+                free(ptr);
+        }
+
+        round.clear();
+        peak = std::max(peak, CountMappings());
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    PerfStop(&perf);
+    double secs = std::chrono::duration<double>(end - start).count();
+
+    printf("vma_count: rounds %zu, blocks %zu, max size %zu\n",
+            rounds, blocks, maxSize);
+    printf("mappings: initial %zu, peak %zu, final %zu\n",
+            initial, peak, CountMappings());
+    printf("time: %.3f s\n", secs);
+    PerfReport(&perf, "total", (double)rounds * blocks);
+
+    for (void* ptr : live)
+        free(ptr);
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+
+#ifndef __XORSHIFT_H
+#define __XORSHIFT_H
+
+// fast pseudo-random numbers for benchmarks, so that generating sizes and
+//  slots doesn't dominate the measured allocator ops
+// state is per thread (or per workload), and must be non-zero
+
+#include <cinttypes>
+
+static inline uint64_t Rand(uint64_t* state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+#endif // __XORSHIFT_H
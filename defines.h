@@ -34,4 +34,34 @@
 #define LIKELY(x)       __builtin_expect((x), 1)
 #define UNLIKELY(x)     __builtin_expect((x), 0)
 
+// memory orderings of the allocator's atomic operations
+// each one is the weakest that's correct, reasoning is next to the
+//  operation. in short:
+// - pushing to a list (partial list, descriptor and superblock free lists,
+//  free'd blocks to an anchor) is a release, to publish the link written
+//  just before it
+// - popping from a list is an acquire, as the popper follows the link
+//  (or writes to the block/descriptor it got)
+// - heap->active is a release/acquire pair, it publishes a descriptor and
+//  the block list of a new superblock
+// - everything else (counters, hints, stores to objects nobody else can
+//  reach yet) is relaxed
+// if 1, every operation is seq_cst instead, to measure what the orderings
+//  buy (see benchmarks/sb_churn.cpp)
+#ifndef LFMALLOC_SEQ_CST
+#define LFMALLOC_SEQ_CST 0
+#endif
+
+#if LFMALLOC_SEQ_CST
+#define MO_RELAXED  std::memory_order_seq_cst
+#define MO_ACQUIRE  std::memory_order_seq_cst
+#define MO_RELEASE  std::memory_order_seq_cst
+#define MO_ACQ_REL  std::memory_order_seq_cst
+#else
+#define MO_RELAXED  std::memory_order_relaxed
+#define MO_ACQUIRE  std::memory_order_acquire
+#define MO_RELEASE  std::memory_order_release
+#define MO_ACQ_REL  std::memory_order_acq_rel
+#endif
+
 #endif // __DEFINES_H__
@@ -0,0 +1,155 @@
+
+#include <pthread.h>
+
+#include "latency.h"
+#include "pages.h"
+#include "log.h"
+
+// head of histogram list
+static std::atomic<ThreadLatency*> Histograms({ nullptr });
+// histogram used by this thread
+static __thread ThreadLatency* Latency LFMALLOC_TLS = nullptr;
+// used to release histogram on thread exit
+static pthread_key_t LatencyKey;
+static pthread_once_t LatencyOnce = PTHREAD_ONCE_INIT;
+
+static char const* EventNames[LAT_EVENTS] = {
+    "malloc",
+    "free",
+    "calloc",
+    "realloc",
+    "MallocFromPartial",
+    "MallocFromNewSB",
+    "large alloc",
+    "large free",
+    "superblock release",
+    "batch from active",
+};
+
+static void LatencyFinalize(void* arg)
+{
+    ThreadLatency* latency = (ThreadLatency*)arg;
+    latency->owned.store(false);
+}
+
+static void LatencyInit()
+{
+    pthread_key_create(&LatencyKey, LatencyFinalize);
+}
+
+static ThreadLatency* LatencyGet()
+{
+    pthread_once(&LatencyOnce, LatencyInit);
+
+    // reuse histogram of an exited thread
+    ThreadLatency* latency = Histograms.load();
+    for (; latency; latency = latency->next)
+    {
+        bool owned = false;
+        if (latency->owned.compare_exchange_strong(owned, true))
+            break;
+    }
+
+    if (!latency)
+    {
+        // pages given by the OS are zero'd
+        latency = (ThreadLatency*)PageAlloc(
+                PAGE_CEILING(sizeof(ThreadLatency)));
+        if (UNLIKELY(!latency))
+            return nullptr;
+
+        PagesMetadata.fetch_add(PAGE_CEILING(sizeof(ThreadLatency)));
+
+        latency->owned.store(true);
+        ThreadLatency* oldHead = Histograms.load();
+        do
+        {
+            latency->next = oldHead;
+        }
+        while (!Histograms.compare_exchange_weak(oldHead, latency));
+    }
+
+    pthread_setspecific(LatencyKey, latency);
+    return latency;
+}
+
+void LatencyRecord(LatencyEvent event, uint64_t cycles)
+{
+    ThreadLatency* latency = Latency;
+    if (UNLIKELY(!latency))
+    {
+        latency = Latency = LatencyGet();
+        if (!latency)
+            return;
+    }
+
+    size_t bucket = 63 - __builtin_clzll(cycles | 1);
+    // single writer, no need for an atomic increment
+    std::atomic<uint64_t>& count = latency->buckets[event][bucket];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+}
+
+extern "C"
+void lr_latency_histogram(int event, uint64_t buckets[LAT_BUCKETS]) noexcept
+{
+    for (size_t idx = 0; idx < LAT_BUCKETS; ++idx)
+        buckets[idx] = 0;
+
+    if (event < 0 || event >= LAT_EVENTS)
+        return;
+
+    ThreadLatency* latency = Histograms.load();
+    for (; latency; latency = latency->next)
+    {
+        for (size_t idx = 0; idx < LAT_BUCKETS; ++idx)
+            buckets[idx] += latency->buckets[event][idx].load(
+                    std::memory_order_relaxed);
+    }
+}
+
+// upper bound (in cycles) of bucket holding percentile p
+static uint64_t Percentile(uint64_t const* buckets, uint64_t total, double p)
+{
+    uint64_t target = (uint64_t)(total * p);
+    uint64_t seen = 0;
+    for (size_t idx = 0; idx < LAT_BUCKETS; ++idx)
+    {
+        seen += buckets[idx];
+        if (seen > target)
+            return 2ULL << idx;
+    }
+
+    return 0;
+}
+
+extern "C"
+void lr_latency_print(FILE* out) noexcept
+{
+    fprintf(out, "%-20s %12s %10s %10s %10s %10s (cycles, <=)\n",
+            "event", "count", "p50", "p99", "p99.9", "max");
+    for (int event = 0; event < LAT_EVENTS; ++event)
+    {
+        uint64_t buckets[LAT_BUCKETS];
+        lr_latency_histogram(event, buckets);
+
+        uint64_t total = 0;
+        uint64_t max = 0;
+        for (size_t idx = 0; idx < LAT_BUCKETS; ++idx)
+        {
+            total += buckets[idx];
+            if (buckets[idx])
+                max = 2ULL << idx;
+        }
+
+        if (!total)
+            continue;
+
+        fprintf(out, "%-20s %12lu %10lu %10lu %10lu %10lu\n",
+                EventNames[event], total,
+                Percentile(buckets, total, 0.5),
+                Percentile(buckets, total, 0.99),
+                Percentile(buckets, total, 0.999),
+                max);
+    }
+}
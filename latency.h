@@ -0,0 +1,86 @@
+
+#ifndef __LATENCY_H
+#define __LATENCY_H
+
+#include <atomic>
+#include <cstdio>
+
+#include "defines.h"
+#include "lrmichael.h"
+
+// if 1, records rdtsc based latency histograms for the malloc interface
+//  and for allocator slow paths
+// opt-in, build with make CPPFLAGS=-DLFMALLOC_LATENCY=1
+#ifndef LFMALLOC_LATENCY
+#define LFMALLOC_LATENCY 0
+#endif
+
+// events with a latency histogram
+enum LatencyEvent
+{
+    LAT_MALLOC              = 0,
+    LAT_FREE                = 1,
+    LAT_CALLOC              = 2,
+    LAT_REALLOC             = 3,
+    // slow paths
+    LAT_MALLOC_FROM_PARTIAL = 4,
+    LAT_MALLOC_FROM_NEW_SB  = 5,
+    // large allocation mmap/munmap
+    LAT_LARGE_ALLOC         = 6,
+    LAT_LARGE_FREE          = 7,
+    // empty superblock given back to the OS
+    LAT_SB_RELEASE          = 8,
+    // all blocks reserved by the active superblock taken at once (e.g
+    //  thread cache refills, see MallocBatchFromActive)
+    LAT_BATCH_FROM_ACTIVE   = 9,
+    LAT_EVENTS              = 10,
+};
+
+// log-bucketed, bucket idx holds events that took
+//  [2^idx, 2^(idx+1)) cycles
+#define LAT_BUCKETS 64
+
+// histograms are per thread, merged on read
+// owned by a single thread, which is the only writer
+struct ThreadLatency
+{
+    std::atomic<uint64_t> buckets[LAT_EVENTS][LAT_BUCKETS];
+    // list of all histograms, push-only
+    ThreadLatency* next;
+    // histograms of exited threads are reused, counts are kept
+    std::atomic<bool> owned;
+};
+
+void LatencyRecord(LatencyEvent event, uint64_t cycles);
+
+#if LFMALLOC_LATENCY
+#include <x86intrin.h>
+
+// records time between construction and destruction
+struct LatencyScope
+{
+    LatencyEvent event;
+    uint64_t start;
+
+    LatencyScope(LatencyEvent e) : event(e), start(__rdtsc()) { }
+    ~LatencyScope() { LatencyRecord(event, __rdtsc() - start); }
+};
+
+#define LATENCY_SCOPE(event) LatencyScope latencyScope(event)
+#else
+#define LATENCY_SCOPE(event)
+#endif
+
+// exports
+extern "C"
+{
+    // merged histogram of event over all (current and exited) threads
+    // all zero if built without LFMALLOC_LATENCY
+    void lr_latency_histogram(int event, uint64_t buckets[LAT_BUCKETS]) noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
+    // prints count and percentiles (in cycles) of every event
+    void lr_latency_print(FILE* out) noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
+}
+
+#endif // __LATENCY_H
@@ -4,9 +4,19 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cinttypes>
+#include <sched.h>
 
 // if 1, enables assertions and other sanity checks
+#ifndef LFMALLOC_SANITY
 #define LFMALLOC_SANITY 0
+#endif
+// if 1, randomly yields or delays at STRESS_POINT()s, placed between
+//  reading shared state and the CAS that publishes a change, to widen
+//  race windows in stress tests (see benchmarks/stress.cpp)
+#ifndef LFMALLOC_STRESS
+#define LFMALLOC_STRESS 0
+#endif
 // if 1, enables debug output
 #define LFMALLOC_DEBUG 0
 
@@ -23,10 +33,38 @@
     fprintf(stderr, "%s:%d %s " STR "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
 
 #if LFMALLOC_SANITY
-#define ASSERT(x) do { if (!(x)) abort(); } while (0)
+#define ASSERT(x) do { if (!(x)) { LOG_ERR("assertion failed: %s", #x); abort(); } } while (0)
 #else
 #define ASSERT(x)
 #endif
 
+#if LFMALLOC_STRESS
+// yields 1/16 of the time, spins for a random delay 1/16 of the time
+inline void StressPoint()
+{
+    static __thread uint64_t state = 0;
+    if (state == 0)
+        state = (uint64_t)&state | 1;
+
+    // xorshift64
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    uint64_t r = state % 16;
+    if (r == 0)
+        sched_yield();
+    else if (r == 1)
+    {
+        for (uint64_t i = (state >> 8) % 256; i > 0; --i)
+            __builtin_ia32_pause();
+    }
+}
+
+#define STRESS_POINT() StressPoint()
+#else
+#define STRESS_POINT()
+#endif
+
 #endif // _LOG_H
 
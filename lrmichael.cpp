@@ -6,36 +6,45 @@
 
 // for ENOMEM
 #include <errno.h>
+#include <pthread.h>
 
 #include "lrmichael.h"
+#include "lrmichael_inline.h"
 #include "size_classes.h"
 #include "pages.h"
+#include "reclaim.h"
 #include "pagemap.h"
+#include "runs.h"
+#include "single_thread.h"
+#include "latency.h"
+#include "probes.h"
 #include "log.h"
 
 // global variables
 // descriptor recycle list
 std::atomic<DescriptorNode> AvailDesc({ nullptr, 0 });
-
-// utilities
-ActiveDescriptor* MakeActive(Descriptor* desc, uint64_t credits)
-{
-    ASSERT(((uint64_t)desc & CREDITS_MASK) == 0);
-    ASSERT(credits < CREDITS_MAX);
-
-    ActiveDescriptor* active = (ActiveDescriptor*)
-        ((uint64_t)desc | credits);
-    return active;
-}
-
-void GetActive(ActiveDescriptor* active, Descriptor** desc, uint64_t* credits)
-{
-    if (desc)
-        *desc = (Descriptor*)((uint64_t)active & ~CREDITS_MASK);
-
-    if (credits)
-        *credits = (uint64_t)active & CREDITS_MASK;
-}
+// all descriptor blocks, push-only
+std::atomic<DescriptorBlock*> DescBlocks({ nullptr });
+// next superblock color
+std::atomic<uint64_t> SbColor({ 0 });
+// empty superblocks
+std::atomic<EmptySuperblockNode> EmptySbs({ nullptr, 0 });
+std::atomic<uint64_t> EmptySbCount({ 0 });
+// bytes of superblocks owned by heaps and of large allocations
+std::atomic<size_t> ActiveBytes({ 0 });
+// per-thread cumulative allocated/deallocated bytes
+__thread uint64_t ThreadAllocated LFMALLOC_TLS = 0;
+__thread uint64_t ThreadDeallocated LFMALLOC_TLS = 0;
+// per-thread free buffers
+static __thread ThreadFreeBuffers FreeBuffers LFMALLOC_TLS;
+// used to flush free buffers on thread exit
+static pthread_key_t FreeBuffersKey;
+// per-thread cache
+__thread ThreadCache TCache LFMALLOC_TLS;
+#if LFMALLOC_THREAD_CACHE
+// used to flush thread cache on thread exit
+static pthread_key_t CacheKey;
+#endif
 
 // (un)register descriptor pages with pagemap
 // all pages used by the descriptor will point to desc in
@@ -57,8 +66,8 @@ void UpdatePageMap(ProcHeap* heap, char* ptr, Descriptor* value)
         return;
     }
 
-    // only need to worry about alignment for large allocations
-    // ASSERT(ptr == superblock);
+    // superblocks are colored, first block may not be at page start
+    ptr = (char*)PAGE_ADDR2BASE(ptr);
 
     // small allocation, (un)register every page
     // could *technically* optimize if blockSize >>> page, 
@@ -90,148 +99,100 @@ Descriptor* GetDescriptorForPtr(void* ptr)
     return info.desc;
 }
 
-void* MallocFromActive(ProcHeap* heap)
-{
-    // reserve block
-    ActiveDescriptor* oldActive = heap->active.load();
-    ActiveDescriptor* newActive;
-    uint64_t oldCredits;
-    do
-    {
-        if (!oldActive)
-            return nullptr;
-
-        Descriptor* oldDesc;
-        GetActive(oldActive, &oldDesc, &oldCredits);
-
-        // if credits > 0, subtract by 1
-        // otherwise set newActive to nullptr
-        newActive = nullptr;
-        if (oldCredits > 0)
-            newActive = MakeActive(oldDesc, oldCredits - 1);
-
-    } while (!heap->active.compare_exchange_weak(
-            oldActive, newActive));
-
-    Descriptor* desc = (Descriptor*)((uint64_t)oldActive & ~CREDITS_MASK);
-
-    LOG_DEBUG("Heap %p, Desc %p", heap, desc);
-
-    // pop block (that we assert exists)
-    // underlying superblock *CANNOT* change after
-    // block reservation, it'll never be empty until we use it
-    char* ptr = nullptr;
-    uint64_t credits = 0;
-
-    // anchor state *CANNOT* be empty
-    // there is at least one reserved block
-    Anchor oldAnchor = desc->anchor.load();
-    Anchor newAnchor;
-    do
-    {
-        ASSERT(oldAnchor.avail < desc->maxcount);
-
-        // compute available block
-        uint64_t blockSize = desc->blockSize;
-        uint64_t avail = oldAnchor.avail;
-        uint64_t offset = avail * blockSize;
-        ptr = (desc->superblock + offset);
-
-        // @todo: synchronize this access
-        uint64_t next = *(uint64_t*)ptr;
-
-        newAnchor = oldAnchor;
-        newAnchor.avail = next;
-        newAnchor.tag++;
-        // last available block
-        if (oldCredits == 0)
-        {
-            // superblock is completely used up
-            if (oldAnchor.count == 0)
-                newAnchor.state = SB_FULL;
-            else
-            {
-                // otherwise, fill up credits
-                credits = std::min<uint64_t>(oldAnchor.count, CREDITS_MAX);
-                newAnchor.count -= credits;
-            }
-        }
-    }
-    while (!desc->anchor.compare_exchange_weak(
-                oldAnchor, newAnchor));
-
-    // can safely read desc fields after CAS, since desc cannot become empty
-    //  until after this fn returns block
-    ASSERT(newAnchor.avail < desc->maxcount || (oldCredits == 0 && oldAnchor.count == 0));
-
-    // credits change, update
-    // while credits == 0, active is nullptr
-    // meaning allocations *CANNOT* come from an active block
-    if (credits > 0)
-        UpdateActive(heap, desc, credits);
-
-    LOG_DEBUG("Heap %p, Desc %p, ptr %p", heap, desc, ptr);
-
-    return (void*)ptr;
-}
-
 void UpdateActive(ProcHeap* heap, Descriptor* desc, uint64_t credits)
 {
-    ActiveDescriptor* oldActive = heap->active.load();
+    // only install desc if there's no active superblock, replacing
+    //  another one would leave it in SB_ACTIVE with nobody to use or
+    //  release it
+    ActiveDescriptor* oldActive = nullptr;
     ActiveDescriptor* newActive = MakeActive(desc, credits - 1);
 
-    if (heap->active.compare_exchange_strong(oldActive, newActive))
+    // release, MallocFromActive reads desc (and the superblock's block
+    //  list, for a new one) after acquiring it
+    STRESS_POINT();
+    if (CasStrong(heap->active, oldActive, newActive,
+                MO_RELEASE, MO_RELAXED))
         return; // all good
 
     // someone installed another active superblock
     // return credits to superblock, make it SB_PARTIAL
     // (because the superblock is no longer active but has available blocks)
+    // relaxed, the block list isn't followed and desc is published by the
+    //  push that follows
     {
-        Anchor oldAnchor = desc->anchor.load();
+        Anchor oldAnchor = desc->anchor.load(MO_RELAXED);
         Anchor newAnchor;
         do
         {
             newAnchor = oldAnchor;
             newAnchor.count += credits;
             newAnchor.state = SB_PARTIAL;
+            STRESS_POINT();
         }
-        while (!desc->anchor.compare_exchange_weak(
-            oldAnchor, newAnchor));
+        while (!CasWeak(desc->anchor,
+            oldAnchor, newAnchor, MO_RELAXED, MO_RELAXED));
     }
 
     HeapPushPartial(desc);
 }
 
-Descriptor* ListPopPartial(ProcHeap* heap)
+// fullness bucket for a partial superblock with count free blocks
+// fullness is only a snapshot, frees can make it emptier later
+size_t PartialBucket(uint64_t count, uint64_t maxcount)
 {
-    DescriptorNode oldHead = heap->partialList.load();
+    uint64_t used = maxcount - count;
+    if (used * 4 > maxcount * 3)
+        return 0;
+
+    if (used * 4 >= maxcount)
+        return 1;
+
+    return 2;
+}
+
+Descriptor* ListPopPartial(ProcHeap* heap, size_t bucket)
+{
+    std::atomic<DescriptorNode>& list = heap->partialList[bucket];
+    // acquire head (on failure too), to read the link its push released
+    DescriptorNode oldHead = LoadNode(list, MO_ACQUIRE);
     DescriptorNode newHead;
     do
     {
         if (!oldHead.desc)
             return nullptr;
 
-        newHead = oldHead.desc->nextPartial.load();
+        // link might be concurrently rewritten if desc is popped and
+        //  pushed again, in which case the CAS fails due to the counter
+        newHead = LoadNode(oldHead.desc->nextPartial, MO_RELAXED);
         newHead.counter = oldHead.counter;
+        STRESS_POINT();
     }
-    while (!heap->partialList.compare_exchange_weak(
-                oldHead, newHead));
+    while (!CasWeak(list,
+                oldHead, newHead, MO_ACQUIRE, MO_ACQUIRE));
 
     return oldHead.desc;
 }
 
-void ListPushPartial(Descriptor* desc)
+void ListPushPartial(Descriptor* desc, size_t bucket)
 {
     ProcHeap* heap = desc->heap;
+    std::atomic<DescriptorNode>& list = heap->partialList[bucket];
 
-    DescriptorNode oldHead = heap->partialList.load();
-    DescriptorNode newHead = { desc, oldHead.counter + 1 };
+    // head isn't followed, only linked to
+    DescriptorNode oldHead = LoadNode(list, MO_RELAXED);
+    DescriptorNode newHead;
     do
     {
-        newHead.desc->nextPartial.store(oldHead); 
+        // published by the release CAS
+        StoreNode(desc->nextPartial, oldHead, MO_RELAXED);
+        // counter must be recomputed after a failed CAS, reusing a stale
+        //  one makes it go backwards and lets a concurrent pop ABA
+        newHead.desc = desc;
+        newHead.counter = oldHead.counter + 1;
+        STRESS_POINT();
     }
-    while (!heap->partialList.compare_exchange_weak(
-                oldHead, newHead));
+    while (!CasWeak(list,
+                oldHead, newHead, MO_RELEASE, MO_RELAXED));
 }
 
 void ListRemoveEmptyDesc(ProcHeap* heap, Descriptor* desc)
@@ -242,12 +203,39 @@ void ListRemoveEmptyDesc(ProcHeap* heap, Descriptor* desc)
 
 void HeapPushPartial(Descriptor* desc)
 {
-    ListPushPartial(desc);
+    LR_PROBE2(partial_push, desc->heap, desc);
+    // desc is on no list, so it can't be reused while we read it
+    // fullness is only a hint
+    Anchor anchor = desc->anchor.load(MO_RELAXED);
+    ListPushPartial(desc, PartialBucket(anchor.count, desc->maxcount));
 }
 
 Descriptor* HeapPopPartial(ProcHeap* heap)
 {
-    return ListPopPartial(heap);
+    // fullest superblocks first
+    // a superblock only gets emptier while in a partial list (e.g it's
+    //  pushed when its first block is freed), so fullness is rechecked
+    //  and superblocks are moved to the right bucket when popped
+    Descriptor* desc = nullptr;
+    for (size_t bucket = 0; bucket < PARTIAL_BUCKETS && !desc; ++bucket)
+    {
+        while ((desc = ListPopPartial(heap, bucket)))
+        {
+            // hint, caller rechecks the state
+            Anchor anchor = desc->anchor.load(MO_RELAXED);
+            if (anchor.state == SB_EMPTY)
+                break; // retired by caller
+
+            size_t actual = PartialBucket(anchor.count, desc->maxcount);
+            if (actual <= bucket)
+                break;
+
+            ListPushPartial(desc, actual);
+        }
+    }
+
+    LR_PROBE2(partial_pop, heap, desc);
+    return desc;
 }
 
 void* MallocFromPartial(ProcHeap* heap)
@@ -256,8 +244,12 @@ void* MallocFromPartial(ProcHeap* heap)
     if (!desc)
         return nullptr;
 
+    LATENCY_SCOPE(LAT_MALLOC_FROM_PARTIAL);
+
     // reserve block
-    Anchor oldAnchor = desc->anchor.load();
+    // acquire, if the superblock is empty desc is retired and reused, so
+    //  the frees that emptied it (and read desc) must happen before
+    Anchor oldAnchor = desc->anchor.load(MO_ACQUIRE);
     Anchor newAnchor;
     uint64_t credits = 0;
 
@@ -283,16 +275,18 @@ void* MallocFromPartial(ProcHeap* heap)
         newAnchor.count -= credits;
         newAnchor.state = (credits > 0) ?
             SB_ACTIVE : SB_FULL;
+        STRESS_POINT();
     }
-    while (!desc->anchor.compare_exchange_weak(
-                oldAnchor, newAnchor));
+    while (!CasWeak(desc->anchor,
+                oldAnchor, newAnchor, MO_ACQUIRE, MO_ACQUIRE));
 
     ASSERT(newAnchor.count < desc->maxcount);
 
     // pop reserved block
     // because of free(), may need to retry
+    // acquire, to read the link of avail, like MallocFromActive
     char* ptr = nullptr;
-    oldAnchor = desc->anchor.load();
+    oldAnchor = desc->anchor.load(MO_ACQUIRE);
 
     do
     {
@@ -305,9 +299,10 @@ void* MallocFromPartial(ProcHeap* heap)
         newAnchor = oldAnchor;
         newAnchor.avail = *(uint64_t*)ptr;
         newAnchor.tag++;
+        STRESS_POINT();
     }
-    while (!desc->anchor.compare_exchange_weak(
-                oldAnchor, newAnchor));
+    while (!CasWeak(desc->anchor,
+                oldAnchor, newAnchor, MO_ACQUIRE, MO_ACQUIRE));
 
     // can safely read desc fields after CAS, since desc cannot become empty
     //  until after this fn returns block
@@ -320,8 +315,74 @@ void* MallocFromPartial(ProcHeap* heap)
     return (void*)ptr;
 }
 
-void* MallocFromNewSB(ProcHeap* heap)
+// superblocks are the same size for all size classes, so an empty
+//  superblock can be reused by any size class, without going to the OS
+// memory isn't zero'd, MallocFromNewSB writes the block list anyway
+void* SuperblockAlloc()
 {
+    // acquire head (on failure too), to read its link, and to get the
+    //  superblock after every write made to it before it was free'd
+    EmptySuperblockNode oldHead = LoadNode(EmptySbs, MO_ACQUIRE);
+    EmptySuperblockNode newHead;
+    do
+    {
+        if (!oldHead.sb)
+        {
+            void* sb = PageAlloc(SB_SZ);
+            if (sb)
+                FetchAdd(ActiveBytes, SB_SZ, MO_RELAXED);
+
+            return sb;
+        }
+
+        // superblock may have been concurrently popped and reused, in
+        //  which case next is garbage but the CAS fails due to the counter
+        // pages are never unmapped, so reading it is safe
+        newHead.sb = oldHead.sb->next;
+        newHead.counter = oldHead.counter + 1;
+        STRESS_POINT();
+    }
+    while (!CasWeak(EmptySbs, oldHead, newHead,
+                MO_ACQUIRE, MO_ACQUIRE));
+
+    // counters are statistics and bounds, they don't order anything
+    FetchSub(EmptySbCount, 1, MO_RELAXED);
+    FetchAdd(ActiveBytes, SB_SZ, MO_RELAXED);
+    return oldHead.sb;
+}
+
+void SuperblockFree(void* sb)
+{
+    FetchSub(ActiveBytes, SB_SZ, MO_RELAXED);
+
+    // pool is full, give physical memory back
+    if (FetchAdd(EmptySbCount, 1, MO_RELAXED) >= SB_POOL_MAX)
+    {
+        FetchSub(EmptySbCount, 1, MO_RELAXED);
+        ReleasePages(sb, SB_SZ);
+        return;
+    }
+
+    EmptySuperblock* empty = (EmptySuperblock*)sb;
+    EmptySuperblockNode oldHead = LoadNode(EmptySbs, MO_RELAXED);
+    EmptySuperblockNode newHead;
+    do
+    {
+        empty->next = oldHead.sb;
+        newHead.sb = empty;
+        newHead.counter = oldHead.counter + 1;
+        STRESS_POINT();
+    }
+    while (!CasWeak(EmptySbs, oldHead, newHead,
+                MO_RELEASE, MO_RELAXED));
+}
+
+// returns nullptr if another thread installed an active superblock, or if
+//  out of memory, in which case *oom is set
+void* MallocFromNewSB(ProcHeap* heap, bool* oom)
+{
+    LATENCY_SCOPE(LAT_MALLOC_FROM_NEW_SB);
+
     SizeClassData const* sc = heap->sizeclass;
 
     Descriptor* desc = DescAlloc();
@@ -330,9 +391,21 @@ void* MallocFromNewSB(ProcHeap* heap)
     desc->heap = heap;
     desc->blockSize = sc->blockSize;
     desc->maxcount = sc->GetBlockNum();
+    desc->run = nullptr;
     // allocate superblock, organize blocks in a linked list
     {
-        desc->superblock = (char*)PageAlloc(sc->sbSize);
+        // rotate first block by a cacheline multiple, so that first blocks
+        //  of different superblocks don't map to the same cache sets
+        uint64_t color = FetchAdd(SbColor, 1, MO_RELAXED) % sc->colors;
+        char* sb = (char*)SuperblockAlloc();
+        if (UNLIKELY(!sb))
+        {
+            DescRetire(desc);
+            *oom = true;
+            return nullptr;
+        }
+
+        desc->superblock = sb + color * CACHELINE;
 
         // ignore "block 0", that's given to the caller
         uint64_t const blockSize = sc->blockSize;
@@ -349,7 +422,8 @@ void* MallocFromNewSB(ProcHeap* heap)
     anchor.state = SB_ACTIVE;
     anchor.tag = 0;
 
-    desc->anchor.store(anchor);
+    // nobody can reach desc yet, it's published by the active CAS
+    desc->anchor.store(anchor, MO_RELAXED);
 
     ASSERT(anchor.avail < desc->maxcount);
     ASSERT(anchor.count < desc->maxcount);
@@ -359,20 +433,23 @@ void* MallocFromNewSB(ProcHeap* heap)
     RegisterDesc(desc);
 
     // try to update active superblock
-    ActiveDescriptor* oldActive = heap->active.load();
+    // release, publishes desc and the block list
+    ActiveDescriptor* oldActive = heap->active.load(MO_RELAXED);
+    STRESS_POINT();
     if (oldActive ||
-        !heap->active.compare_exchange_strong(
-            oldActive, newActive))
+        !CasStrong(heap->active,
+            oldActive, newActive, MO_RELEASE, MO_RELAXED))
     {
         // CAS fail, there's already an active superblock
         // unregister descriptor
         UnregisterDesc(desc->heap, desc->superblock);
-        PageFree(desc->superblock, sc->sbSize);
+        SuperblockFree(PAGE_ADDR2BASE(desc->superblock));
         DescRetire(desc);
         return nullptr;
     }
 
     char* ptr = desc->superblock;
+    LR_PROBE3(sb_alloc, desc, ptr, desc->blockSize);
     LOG_DEBUG("desc: %p, ptr: %p", desc, ptr);
     return (void*)ptr;
 }
@@ -382,31 +459,403 @@ void RemoveEmptyDesc(ProcHeap* heap, Descriptor* desc)
     ListRemoveEmptyDesc(heap, desc);
 }
 
+void FreeBlocks(Descriptor* desc, uint64_t head, char* tail, uint64_t count)
+{
+    ProcHeap* heap = desc->heap;
+    char* superblock = desc->superblock;
+    // after CAS, desc might become empty and
+    //  concurrently reused, so store maxcount
+    uint64_t maxcount = desc->maxcount;
+
+    LOG_DEBUG("Heap %p, Desc %p, count %lu", heap, desc, count);
+
+    // avail is only linked to, not followed
+    Anchor oldAnchor = desc->anchor.load(MO_RELAXED);
+    Anchor newAnchor;
+    do
+    {
+        // link chain to anchor.avail
+        *(uint64_t*)tail = oldAnchor.avail;
+
+        newAnchor = oldAnchor;
+        newAnchor.avail = head;
+        // state updates
+        // don't set SB_PARTIAL if state == SB_ACTIVE
+        if (oldAnchor.state == SB_FULL)
+            newAnchor.state = SB_PARTIAL;
+        // this can't happen with SB_ACTIVE
+        // because of reserved blocks
+        if (oldAnchor.count + count == maxcount)
+            newAnchor.state = SB_EMPTY; // can free superblock
+        else
+            newAnchor.count += count;
+        STRESS_POINT();
+    }
+    // release, publishes the chain's links (and the blocks' last use) to
+    //  the thread that pops them
+    // acquire as well, if the superblock becomes empty, every other
+    //  block's free must happen before it's reused
+    while (!CasWeak(desc->anchor,
+                oldAnchor, newAnchor, MO_ACQ_REL, MO_RELAXED));
+
+    // after last CAS, can't reliably read any desc fields
+    // as desc might have become empty and been concurrently reused
+    ASSERT(oldAnchor.avail < maxcount || oldAnchor.state == SB_FULL);
+    ASSERT(newAnchor.avail < maxcount);
+    ASSERT(newAnchor.count < maxcount);
+
+    // CAS success, can free block
+    if (newAnchor.state == SB_EMPTY)
+    {
+        LATENCY_SCOPE(LAT_SB_RELEASE);
+
+        LR_PROBE3(sb_free, desc, superblock, heap->sizeclass->sbSize);
+
+        // unregister descriptor
+        UnregisterDesc(heap, superblock);
+
+        // free superblock
+        SuperblockFree(PAGE_ADDR2BASE(superblock));
+        // a full superblock isn't in any partial list, so nobody else
+        //  will retire its descriptor (possible when freeing >1 blocks)
+        if (oldAnchor.state == SB_FULL)
+            DescRetire(desc);
+        else
+            RemoveEmptyDesc(heap, desc);
+    }
+    else if (oldAnchor.state == SB_FULL)
+        HeapPushPartial(desc);
+}
+
+void FlushFreeBuffer(FreeBuffer& buf)
+{
+    ASSERT(buf.desc);
+    FreeBlocks(buf.desc, buf.head, buf.tail, buf.count);
+    buf.desc = nullptr;
+    buf.count = 0;
+}
+
+bool FlushFreeBuffers()
+{
+    ThreadFreeBuffers& tb = FreeBuffers;
+    bool flushed = false;
+    for (size_t idx = 0; idx < FREE_BUFFER_NUM; ++idx)
+    {
+        FreeBuffer& buf = tb.buffers[idx];
+        if (buf.desc)
+        {
+            FlushFreeBuffer(buf);
+            flushed = true;
+        }
+    }
+
+    tb.ops = 0;
+    return flushed;
+}
+
+// pthread key destructor, called on thread exit
+static void FinalizeFreeBuffers(void* arg)
+{
+    (void)arg;
+    FlushFreeBuffers();
+    // frees made after this point go directly to the superblock
+    // (e.g blocks flushed by the thread cache's destructor, if it runs
+    //  later), registered must be reset for BufferFree to check finalized
+    ThreadFreeBuffers& tb = FreeBuffers;
+    tb.finalized = true;
+    tb.registered = false;
+}
+
+// buffers block ptr (with index idx in desc's superblock)
+// blocks from the same superblock are chained and later released
+//  with a single anchor CAS, see FreeBlocks
+// returns false if block can't be buffered
+bool BufferFree(Descriptor* desc, uint64_t idx, char* ptr)
+{
+    ThreadFreeBuffers& tb = FreeBuffers;
+    if (UNLIKELY(!tb.registered))
+    {
+        if (tb.finalized)
+            return false;
+
+        // value must be non-null for destructor to be called
+        pthread_setspecific(FreeBuffersKey, &tb);
+        tb.registered = true;
+    }
+
+    // time bound, don't keep blocks away from other threads for too long
+    if (UNLIKELY(++tb.ops >= FREE_BUFFER_FLUSH_OPS))
+        FlushFreeBuffers();
+
+    FreeBuffer* empty = nullptr;
+    for (size_t bufIdx = 0; bufIdx < FREE_BUFFER_NUM; ++bufIdx)
+    {
+        FreeBuffer& buf = tb.buffers[bufIdx];
+        if (buf.desc == desc)
+        {
+            *(uint64_t*)ptr = buf.head;
+            buf.head = idx;
+            if (++buf.count == FREE_BUFFER_MAX)
+                FlushFreeBuffer(buf);
+
+            return true;
+        }
+
+        if (!buf.desc)
+            empty = &buf;
+    }
+
+    // all buffers in use, evict one
+    if (!empty)
+    {
+        empty = &tb.buffers[tb.victim++ % FREE_BUFFER_NUM];
+        FlushFreeBuffer(*empty);
+    }
+
+    empty->desc = desc;
+    empty->head = idx;
+    empty->tail = ptr;
+    empty->count = 1;
+    return true;
+}
+
+// thread cache
+// a bin's capacity adapts to how the thread uses the size class:
+// - a refill (bin was empty) doubles it, up to the bin's limit
+// - a flush (bin was full) without a refill since the last one halves it,
+//  so threads that mostly free a size class don't hoard its blocks
+// - every CACHE_GC_OPS cache ops, blocks that weren't needed since the
+//  last gc (bin's low water mark) are mostly flushed and capacity halved,
+//  trimming size classes the thread stopped using
+#if LFMALLOC_THREAD_CACHE
+// max capacity of bin for size class scIdx
+static uint32_t CacheBinLimit(size_t scIdx)
+{
+    size_t limit = CACHE_BIN_BYTES / SizeClasses[scIdx].blockSize;
+    limit = std::max<size_t>(limit, CACHE_BIN_MIN);
+    return std::min<size_t>(limit, CACHE_BIN_MAX);
+}
+
+// returns false if thread cache can't be used
+static bool CacheInitBin(size_t scIdx)
+{
+    ThreadCache& tc = TCache;
+    if (UNLIKELY(!tc.registered))
+    {
+        if (tc.finalized)
+            return false;
+
+        // value must be non-null for destructor to be called
+        pthread_setspecific(CacheKey, &tc);
+        tc.registered = true;
+    }
+
+    CacheBin& bin = tc.bins[scIdx];
+    if (bin.max == 0)
+        bin.max = std::min<uint32_t>(CACHE_BIN_INIT, CacheBinLimit(scIdx));
+
+    return true;
+}
+
+// bin for heap is empty, refill it
+// returns a block, or nullptr if thread cache can't be used
+void* CacheRefill(ProcHeap* heap)
+{
+    size_t scIdx = heap - Heaps;
+    if (UNLIKELY(!CacheInitBin(scIdx)))
+        return nullptr;
+
+    CacheBin& bin = TCache.bins[scIdx];
+    if (bin.refills > 0)
+        bin.max = std::min(bin.max * 2, CacheBinLimit(scIdx));
+
+    bin.refills++;
+    bin.refilled = true;
+
+    // fill half of bin, plus block that's returned
+    void* blocks[CACHE_BIN_MAX / 2 + 1];
+    size_t count = MallocBatch(heap, bin.max / 2 + 1, blocks);
+    if (UNLIKELY(count == 0))
+        return nullptr;
+
+    for (size_t idx = 1; idx < count; ++idx)
+    {
+        char* ptr = (char*)blocks[idx];
+        *(char**)ptr = bin.head;
+        bin.head = ptr;
+    }
+
+    bin.count += count - 1;
+    return blocks[0];
+}
+
+// bin for size class scIdx is full, flush part of it and cache ptr
+// returns false if thread cache can't be used
+bool CacheOverflow(size_t scIdx, char* ptr)
+{
+    if (UNLIKELY(!CacheInitBin(scIdx)))
+        return false;
+
+    CacheBin& bin = TCache.bins[scIdx];
+    if (bin.count >= bin.max)
+    {
+        if (!bin.refilled)
+            bin.max = std::max<uint32_t>(bin.max / 2, CACHE_BIN_MIN);
+
+        bin.flushes++;
+        bin.refilled = false;
+        CacheFlush(bin, bin.count - bin.max / 2);
+    }
+
+    bool pushed = CachePush(scIdx, ptr);
+    (void)pushed; // suppress unused variable warning
+    ASSERT(pushed);
+    return true;
+}
+
+// returns n blocks of bin to their superblocks
+void CacheFlush(CacheBin& bin, uint64_t n)
+{
+    ASSERT(n <= bin.count);
+    for (uint64_t idx = 0; idx < n; ++idx)
+    {
+        char* ptr = bin.head;
+        bin.head = *(char**)ptr;
+        FreeBlock(GetDescriptorForPtr(ptr), ptr);
+    }
+
+    bin.count -= n;
+    if (bin.lowWater > bin.count)
+        bin.lowWater = bin.count;
+}
+
+void CacheGC()
+{
+    ThreadCache& tc = TCache;
+    tc.ops = 0;
+    for (size_t scIdx = 1; scIdx < MAX_SZ_IDX; ++scIdx)
+    {
+        CacheBin& bin = tc.bins[scIdx];
+        if (bin.lowWater > 0)
+        {
+            // flush ~3/4 of blocks that weren't needed
+            CacheFlush(bin, (bin.lowWater * 3 + 3) / 4);
+            bin.max = std::max<uint32_t>(bin.max / 2, CACHE_BIN_MIN);
+        }
+
+        bin.lowWater = bin.count;
+    }
+}
+
+// pthread key destructor, called on thread exit
+static void FinalizeThreadCache(void* arg)
+{
+    (void)arg;
+    lr_thread_cache_flush();
+    // frees made after this point bypass the cache
+    ThreadCache& tc = TCache;
+    tc.finalized = true;
+    tc.registered = false;
+    for (size_t scIdx = 0; scIdx < MAX_SZ_IDX; ++scIdx)
+        tc.bins[scIdx].max = 0;
+}
+#endif
+
+extern "C"
+void lr_thread_cache_flush() noexcept
+{
+#if LFMALLOC_THREAD_CACHE
+    ThreadCache& tc = TCache;
+    for (size_t scIdx = 1; scIdx < MAX_SZ_IDX; ++scIdx)
+    {
+        CacheBin& bin = tc.bins[scIdx];
+        CacheFlush(bin, bin.count);
+    }
+#endif
+
+    // flushed blocks (and other frees) may be sitting in the free buffers
+    FlushFreeBuffers();
+}
+
+extern "C"
+size_t lr_thread_cache_stats(lr_cache_bin_stats* stats, size_t n) noexcept
+{
+#if LFMALLOC_THREAD_CACHE
+    ThreadCache& tc = TCache;
+    size_t count = std::min<size_t>(n, MAX_SZ_IDX - 1);
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        CacheBin const& bin = tc.bins[idx + 1];
+        stats[idx].block_size = SizeClasses[idx + 1].blockSize;
+        stats[idx].count = bin.count;
+        stats[idx].max = bin.max;
+        stats[idx].refills = bin.refills;
+        stats[idx].flushes = bin.flushes;
+    }
+
+    return count;
+#else
+    (void)stats;
+    (void)n;
+    return 0;
+#endif
+}
+
+// descriptor block registry
+// descriptors are never freed, so every descriptor can be found by
+//  walking the blocks they were allocated in
+void DescBlockRegister(DescriptorBlock* block)
+{
+    // release, publishes block->next to heap walks
+    DescriptorBlock* oldHead = DescBlocks.load(MO_RELAXED);
+    do
+    {
+        block->next = oldHead;
+        STRESS_POINT();
+    }
+    while (!CasWeak(DescBlocks, oldHead, block,
+                MO_RELEASE, MO_RELAXED));
+}
+
 Descriptor* DescAlloc()
 {
-    DescriptorNode oldHead = AvailDesc.load();
+    // acquire head (on failure too), to read its link, and to get the
+    //  descriptor after every read of it made before it was retired
+    DescriptorNode oldHead = LoadNode(AvailDesc, MO_ACQUIRE);
     while (true)
     {
         if (oldHead.desc)
         {
-            DescriptorNode newHead = oldHead.desc->nextFree.load();
+            // like ListPopPartial, a stale link fails the CAS
+            DescriptorNode newHead =
+                LoadNode(oldHead.desc->nextFree, MO_RELAXED);
             newHead.counter = oldHead.counter;
-            if (AvailDesc.compare_exchange_weak(oldHead, newHead))
+            STRESS_POINT();
+            if (CasWeak(AvailDesc, oldHead, newHead,
+                        MO_ACQUIRE, MO_ACQUIRE))
+            {
+                LR_PROBE1(desc_alloc, oldHead.desc);
                 return oldHead.desc;
+            }
         }
         else
         {
             // allocate several pages
-            // get first descriptor, this is returned to caller
+            // first descriptor slot is used as block header
             char* ptr = (char*)PageAlloc(DESCRIPTOR_BLOCK_SZ);
-            Descriptor* ret = (Descriptor*)ptr;
+            LR_PROBE2(desc_block_alloc, ptr, DESCRIPTOR_BLOCK_SZ);
+            FetchAdd(PagesMetadata, DESCRIPTOR_BLOCK_SZ, MO_RELAXED);
+            DescBlockRegister((DescriptorBlock*)ptr);
+            // get first descriptor, this is returned to caller
+            Descriptor* ret = (Descriptor*)(ptr + sizeof(Descriptor));
             // organize list with the rest of descriptors
             // and add to available descriptors
+            // links are published by the release CAS
             {
                 Descriptor* first = nullptr;
                 Descriptor* prev = nullptr;
 
-                char* currPtr = ptr + sizeof(Descriptor);
+                char* currPtr = (char*)ret + sizeof(Descriptor);
                 currPtr = ALIGN_ADDR(currPtr, CACHELINE);
                 first = (Descriptor*)currPtr;
                 while (currPtr + sizeof(Descriptor) <
@@ -414,25 +863,27 @@ Descriptor* DescAlloc()
                 {
                     Descriptor* curr = (Descriptor*)currPtr;
                     if (prev)
-                        prev->nextFree.store({curr, 0});
+                        prev->nextFree.store({curr, 0}, MO_RELAXED);
 
                     prev = curr;
                     currPtr = currPtr + sizeof(Descriptor);
                     currPtr = ALIGN_ADDR(currPtr, CACHELINE);
                 }
 
-                prev->nextFree.store({nullptr, 0});
+                prev->nextFree.store({nullptr, 0}, MO_RELAXED);
 
                 // add list to available descriptors
-                DescriptorNode oldHead = AvailDesc.load();
+                DescriptorNode oldHead = LoadNode(AvailDesc, MO_RELAXED);
                 DescriptorNode newHead;
                 do
                 {
-                    prev->nextFree.store(oldHead);
+                    StoreNode(prev->nextFree, oldHead, MO_RELAXED);
                     newHead.desc = first;
                     newHead.counter = oldHead.counter + 1;
+                    STRESS_POINT();
                 }
-                while (!AvailDesc.compare_exchange_weak(oldHead, newHead));
+                while (!CasWeak(AvailDesc, oldHead, newHead,
+                            MO_RELEASE, MO_RELAXED));
             }
 
             return ret;
@@ -442,20 +893,38 @@ Descriptor* DescAlloc()
 
 void DescRetire(Descriptor* desc)
 {
-    DescriptorNode oldHead = AvailDesc.load();
+    // release, the next DescAlloc of desc must come after our uses of it
+    DescriptorNode oldHead = LoadNode(AvailDesc, MO_RELAXED);
     DescriptorNode newHead;
     do
     {
-        desc->nextFree.store(oldHead);
+        StoreNode(desc->nextFree, oldHead, MO_RELAXED);
         newHead.desc = desc;
         newHead.counter = oldHead.counter + 1;
+        STRESS_POINT();
     }
-    while (!AvailDesc.compare_exchange_weak(oldHead, newHead));
+    while (!CasWeak(AvailDesc, oldHead, newHead,
+                MO_RELEASE, MO_RELAXED));
 }
 
 static bool MallocInit = false;
 ProcHeap Heaps[MAX_SZ_IDX];
 
+// init a set of heaps, one per size class
+void InitHeaps(ProcHeap* heaps)
+{
+    for (size_t idx = 0; idx < MAX_SZ_IDX; ++idx)
+    {
+        // heaps aren't shared yet (arenas are published by their creator,
+        //  global heaps are initialized before threads use them)
+        ProcHeap& heap = heaps[idx];
+        heap.active.store(nullptr, MO_RELAXED);
+        for (size_t bucket = 0; bucket < PARTIAL_BUCKETS; ++bucket)
+            heap.partialList[bucket].store({nullptr, 0}, MO_RELAXED);
+        heap.sizeclass = &SizeClasses[idx];
+    }
+}
+
 void InitMalloc()
 {
     LOG_DEBUG();
@@ -467,13 +936,12 @@ void InitMalloc()
     InitSizeClass();
 
     // init heaps
-    for (size_t idx = 0; idx < MAX_SZ_IDX; ++idx)
-    {
-        ProcHeap& heap = Heaps[idx];
-        heap.active.store(nullptr);
-        heap.partialList.store({nullptr, 0});
-        heap.sizeclass = &SizeClasses[idx];
-    }
+    InitHeaps(Heaps);
+
+    pthread_key_create(&FreeBuffersKey, FinalizeFreeBuffers);
+#if LFMALLOC_THREAD_CACHE
+    pthread_key_create(&CacheKey, FinalizeThreadCache);
+#endif
 }
 
 ProcHeap* GetProcHeap(size_t size)
@@ -489,39 +957,54 @@ ProcHeap* GetProcHeap(size_t size)
     return nullptr;
 }
 
-extern "C"
-void* lr_malloc(size_t size) noexcept
+// large block allocation
+void* MallocLarge(size_t size)
 {
-    LOG_DEBUG("size: %lu", size);
+    LATENCY_SCOPE(LAT_LARGE_ALLOC);
 
-    // size class calculation
-    ProcHeap* heap = GetProcHeap(size);
-    // large block allocation
-    if (UNLIKELY(!heap))
+    size_t pages = PAGE_CEILING(size);
+    Descriptor* desc = DescAlloc();
+    ASSERT(desc);
+
+    desc->heap = nullptr;
+    desc->blockSize = pages;
+    desc->maxcount = 1;
+    desc->run = nullptr;
+    // medium allocations are carved from shared run superblocks
+    if (pages <= MAX_RUN_SZ)
+        desc->superblock = (char*)RunAlloc(pages, &desc->run);
+    else
+        desc->superblock = (char*)PageAllocDirect(pages);
+
+    if (UNLIKELY(!desc->superblock))
     {
-        size_t pages = PAGE_CEILING(size);
-        Descriptor* desc = DescAlloc();
-        ASSERT(desc);
+        DescRetire(desc);
+        return nullptr;
+    }
 
-        desc->heap = nullptr;
-        desc->blockSize = pages;
-        desc->maxcount = 1;
-        desc->superblock = (char*)PageAlloc(pages);
+    Anchor anchor;
+    anchor.avail = 0;
+    anchor.count = 0;
+    anchor.state = SB_FULL;
+    anchor.tag = 0;
 
-        Anchor anchor;
-        anchor.avail = 0;
-        anchor.count = 0;
-        anchor.state = SB_FULL;
-        anchor.tag = 0;
+    // not shared, the block is handed to the caller
+    desc->anchor.store(anchor, MO_RELAXED);
 
-        desc->anchor.store(anchor);
+    RegisterDesc(desc);
+    FetchAdd(ActiveBytes, pages, MO_RELAXED);
+    ThreadAllocated += pages;
+    LR_PROBE2(large_alloc, desc->superblock, pages);
 
-        RegisterDesc(desc);
+    char* ptr = desc->superblock;
+    LOG_DEBUG("large, ptr: %p", ptr);
+    return (void*)ptr;
+}
 
-        char* ptr = desc->superblock;
-        LOG_DEBUG("large, ptr: %p", ptr);
-        return (void*)ptr;
-    }
+// allocates a block of heap's size class
+void* MallocFromHeap(ProcHeap* heap)
+{
+    ThreadAllocated += heap->sizeclass->blockSize;
 
     while (1)
     {
@@ -537,18 +1020,283 @@ void* lr_malloc(size_t size) noexcept
             return ptr;
         }
 
-        if (void* ptr = MallocFromNewSB(heap))
+#if LFMALLOC_FREE_BATCH
+        // blocks buffered by this thread might avoid a new superblock
+        if (FlushFreeBuffers())
+            continue;
+#endif
+
+        bool oom = false;
+        if (void* ptr = MallocFromNewSB(heap, &oom))
         {
             LOG_DEBUG("MallocFromNewSB, ptr: %p", ptr);
             return ptr;
         }
+
+        if (UNLIKELY(oom))
+            return nullptr;
     }
 }
 
+extern "C"
+void* lr_malloc(size_t size) noexcept
+{
+    LOG_DEBUG("size: %lu", size);
+    LATENCY_SCOPE(LAT_MALLOC);
+
+    // size class calculation
+    ProcHeap* heap = GetProcHeap(size);
+    // large block allocation
+    if (UNLIKELY(!heap))
+        return MallocLarge(size);
+
+#if LFMALLOC_THREAD_CACHE
+    void* ptr = CachePop(heap - Heaps);
+    if (UNLIKELY(!ptr))
+        ptr = CacheRefill(heap);
+
+    if (LIKELY(ptr != nullptr))
+    {
+        ThreadAllocated += heap->sizeclass->blockSize;
+        return ptr;
+    }
+#endif
+
+    return MallocFromHeap(heap);
+}
+
+extern "C"
+lr_arena* lr_arena_create() noexcept
+{
+    if (UNLIKELY(!MallocInit))
+        InitMalloc();
+
+    lr_arena* arena = (lr_arena*)PageAlloc(PAGE_CEILING(sizeof(lr_arena)));
+    if (UNLIKELY(!arena))
+        return nullptr;
+
+    FetchAdd(PagesMetadata, PAGE_CEILING(sizeof(lr_arena)), MO_RELAXED);
+
+    InitHeaps(arena->heaps);
+    return arena;
+}
+
+extern "C"
+void* lr_arena_malloc(lr_arena* arena, size_t size) noexcept
+{
+    LOG_DEBUG("arena: %p, size: %lu", arena, size);
+    LATENCY_SCOPE(LAT_MALLOC);
+
+    // large allocations don't belong to any heap
+    size_t scIdx = GetSizeClass(size);
+    if (UNLIKELY(!scIdx))
+        return MallocLarge(size);
+
+    return MallocFromHeap(&arena->heaps[scIdx]);
+}
+
+// walks the first n blocks of desc's avail chain, starting at avail,
+//  into out, and stores the idx of the block after them in next
+// blocks might be concurrently allocated and written to by threads
+//  holding reservations, so links are bounds checked
+// returns false if the chain was inconsistent, caller must reload anchor
+bool WalkBlocks(Descriptor* desc, uint64_t avail, uint64_t n, void** out,
+        uint64_t* next)
+{
+    char* superblock = desc->superblock;
+    uint64_t blockSize = desc->blockSize;
+    uint64_t maxcount = desc->maxcount;
+    for (uint64_t i = 0; i < n; ++i)
+    {
+        if (UNLIKELY(avail >= maxcount))
+            return false;
+
+        char* ptr = superblock + avail * blockSize;
+        out[i] = ptr;
+        avail = *(uint64_t*)ptr;
+    }
+
+    // last link can be garbage if the superblock becomes full
+    *next = avail;
+    return true;
+}
+
+// takes all blocks reserved by the active superblock and pops up to n
+//  blocks with a single anchor CAS, reserving the rest again
+// returns number of blocks allocated
+size_t MallocBatchFromActive(ProcHeap* heap, size_t n, void** out)
+{
+    // take all credits, like MallocFromActive with the last credit
+    ActiveDescriptor* oldActive = heap->active.load(MO_RELAXED);
+    do
+    {
+        if (!oldActive)
+            return 0;
+        STRESS_POINT();
+    }
+    while (!CasWeak(heap->active, oldActive, nullptr,
+                MO_ACQUIRE, MO_RELAXED));
+
+    LATENCY_SCOPE(LAT_BATCH_FROM_ACTIVE);
+
+    Descriptor* desc;
+    uint64_t oldCredits;
+    GetActive(oldActive, &desc, &oldCredits);
+
+    // blocks reserved for us
+    uint64_t reserved = oldCredits + 1;
+
+    uint64_t taken = 0;
+    uint64_t credits = 0;
+    // acquire, links are followed (see MallocFromActive)
+    Anchor oldAnchor = desc->anchor.load(MO_ACQUIRE);
+    Anchor newAnchor;
+    do
+    {
+        uint64_t avail = reserved + oldAnchor.count;
+        taken = std::min<uint64_t>(n, avail);
+        credits = std::min<uint64_t>(avail - taken, CREDITS_MAX);
+
+        uint64_t next;
+        if (!WalkBlocks(desc, oldAnchor.avail, taken, out, &next))
+        {
+            oldAnchor = desc->anchor.load(MO_ACQUIRE);
+            continue;
+        }
+
+        newAnchor = oldAnchor;
+        newAnchor.avail = next;
+        newAnchor.count = avail - taken - credits;
+        newAnchor.tag++;
+        if (credits == 0)
+            newAnchor.state = SB_FULL;
+
+        STRESS_POINT();
+        if (CasWeak(desc->anchor, oldAnchor, newAnchor,
+                    MO_ACQUIRE, MO_ACQUIRE))
+            break;
+    }
+    while (true);
+
+    if (credits > 0)
+        UpdateActive(heap, desc, credits);
+
+    return taken;
+}
+
+// like MallocFromPartial, but pops up to n blocks with a single anchor CAS
+// returns number of blocks allocated
+size_t MallocBatchFromPartial(ProcHeap* heap, size_t n, void** out)
+{
+    Descriptor* desc = HeapPopPartial(heap);
+    if (!desc)
+        return 0;
+
+    LATENCY_SCOPE(LAT_MALLOC_FROM_PARTIAL);
+
+    // we own desc, anchor can only change due to free()
+    // acquire, like MallocFromPartial
+    uint64_t taken = 0;
+    uint64_t credits = 0;
+    Anchor oldAnchor = desc->anchor.load(MO_ACQUIRE);
+    Anchor newAnchor;
+    do
+    {
+        if (oldAnchor.state == SB_EMPTY)
+        {
+            DescRetire(desc);
+            // retry
+            return MallocBatchFromPartial(heap, n, out);
+        }
+
+        // frees only push to the chain, so it's always consistent
+        taken = std::min<uint64_t>(n, oldAnchor.count);
+        credits = std::min<uint64_t>(oldAnchor.count - taken, CREDITS_MAX);
+
+        uint64_t next = 0;
+        bool ok = WalkBlocks(desc, oldAnchor.avail, taken, out, &next);
+        (void)ok; // suppress unused variable warning
+        ASSERT(ok);
+
+        newAnchor = oldAnchor;
+        newAnchor.avail = next;
+        newAnchor.count -= taken + credits;
+        newAnchor.state = (credits > 0) ? SB_ACTIVE : SB_FULL;
+        newAnchor.tag++;
+        STRESS_POINT();
+    }
+    while (!CasWeak(desc->anchor, oldAnchor, newAnchor,
+                MO_ACQUIRE, MO_ACQUIRE));
+
+    if (credits > 0)
+        UpdateActive(heap, desc, credits);
+
+    return taken;
+}
+
+extern "C"
+size_t lr_malloc_batch(size_t size, size_t n, void** out) noexcept
+{
+    LOG_DEBUG("size: %lu, n: %lu", size, n);
+
+    ProcHeap* heap = GetProcHeap(size);
+    // large allocations are done one by one
+    if (UNLIKELY(!heap))
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i] = MallocLarge(size);
+            if (UNLIKELY(!out[i]))
+                return i;
+        }
+
+        return n;
+    }
+
+    size_t count = MallocBatch(heap, n, out);
+    ThreadAllocated += count * heap->sizeclass->blockSize;
+    return count;
+}
+
+// allocates n blocks of heap's size class into out
+size_t MallocBatch(ProcHeap* heap, size_t n, void** out)
+{
+    size_t count = 0;
+    while (count < n)
+    {
+        count += MallocBatchFromActive(heap, n - count, out + count);
+        if (count == n)
+            break;
+
+        // partial superblock might not have had enough blocks, try another
+        if (size_t taken = MallocBatchFromPartial(heap, n - count, out + count))
+        {
+            count += taken;
+            continue;
+        }
+
+#if LFMALLOC_FREE_BATCH
+        // blocks buffered by this thread might avoid a new superblock
+        if (FlushFreeBuffers())
+            continue;
+#endif
+
+        // installs a new active superblock, rest comes from it
+        bool oom = false;
+        if (void* ptr = MallocFromNewSB(heap, &oom))
+            out[count++] = ptr;
+        else if (UNLIKELY(oom))
+            break;
+    }
+
+    return count;
+}
+
 extern "C"
 void* lr_calloc(size_t n, size_t size) noexcept
 {
     LOG_DEBUG();
+    LATENCY_SCOPE(LAT_CALLOC);
     size_t allocSize = n * size;
     // overflow check
     // @todo: expensive, need to optimize
@@ -566,10 +1314,91 @@ void* lr_calloc(size_t n, size_t size) noexcept
     return ptr;
 }
 
+// resize large allocation (that starts at desc->superblock) to size
+// pages are remapped with mremap, so contents are never copied
+// returns nullptr on failure
+void* ReallocLarge(Descriptor* desc, size_t size)
+{
+    ASSERT(!desc->heap);
+    ASSERT(!desc->run);
+
+    size_t oldPages = desc->blockSize;
+    size_t newPages = PAGE_CEILING(size);
+    char* oldPtr = desc->superblock;
+    if (newPages == oldPages)
+        return oldPtr;
+
+    // old pages can be mapped by another thread as soon as they're
+    //  remapped, unregister before so we don't clobber its pagemap entry
+    UnregisterDesc(nullptr, oldPtr);
+
+    char* newPtr = (char*)PageRealloc(oldPtr, oldPages, newPages);
+    if (UNLIKELY(!newPtr))
+    {
+        RegisterDesc(desc);
+        return nullptr;
+    }
+
+    // only the caller owns the allocation, desc can be safely updated
+    //  before it's registered again
+    desc->superblock = newPtr;
+    desc->blockSize = newPages;
+    RegisterDesc(desc);
+
+    FetchAdd(ActiveBytes, newPages, MO_RELAXED);
+    FetchSub(ActiveBytes, oldPages, MO_RELAXED);
+    ThreadAllocated += newPages;
+    ThreadDeallocated += oldPages;
+
+    LOG_DEBUG("large, ptr: %p, newPtr: %p", oldPtr, newPtr);
+    return newPtr;
+}
+
+// resize medium allocation (that starts at desc->superblock) in place
+// returns nullptr on failure
+void* ReallocRun(Descriptor* desc, size_t size)
+{
+    ASSERT(!desc->heap);
+    ASSERT(desc->run);
+
+    size_t oldPages = desc->blockSize;
+    size_t newPages = PAGE_CEILING(size);
+    char* ptr = desc->superblock;
+    if (newPages > MAX_RUN_SZ ||
+        !RunResize(desc->run, ptr, oldPages, newPages))
+        return nullptr;
+
+    desc->blockSize = newPages;
+
+    FetchAdd(ActiveBytes, newPages, MO_RELAXED);
+    FetchSub(ActiveBytes, oldPages, MO_RELAXED);
+    ThreadAllocated += newPages;
+    ThreadDeallocated += oldPages;
+
+    LOG_DEBUG("run, ptr: %p", ptr);
+    return ptr;
+}
+
 extern "C"
 void* lr_realloc(void* ptr, size_t size) noexcept
 {
     LOG_DEBUG();
+    LATENCY_SCOPE(LAT_REALLOC);
+    if (LIKELY(ptr != nullptr) && GetSizeClass(size) == 0)
+    {
+        Descriptor* desc = GetDescriptorForPtr(ptr);
+        ASSERT(desc);
+
+        // large to large, aligned large allocations not supported
+        if (!desc->heap && (char*)ptr == desc->superblock)
+        {
+            void* newPtr = desc->run ?
+                ReallocRun(desc, size) : ReallocLarge(desc, size);
+            if (newPtr)
+                return newPtr;
+        }
+    }
+
     void* newPtr = lr_malloc(size);
     if (LIKELY(ptr && newPtr))
     {
@@ -667,6 +1496,8 @@ void lr_free(void* ptr) noexcept
     if (UNLIKELY(!ptr))
         return;
 
+    LATENCY_SCOPE(LAT_FREE);
+
     Descriptor* desc = GetDescriptorForPtr(ptr);
     if (UNLIKELY(!desc))
     {
@@ -682,9 +1513,14 @@ void lr_free(void* ptr) noexcept
     
     LOG_DEBUG("Heap %p, Desc %p, ptr %p", heap, desc, ptr);
 
+    ThreadDeallocated += desc->blockSize;
+
     // large allocation case
     if (UNLIKELY(!heap))
     {
+        LATENCY_SCOPE(LAT_LARGE_FREE);
+        LR_PROBE2(large_free, superblock, desc->blockSize);
+
         // unregister descriptor
         UnregisterDesc(nullptr, superblock);
         // aligned large allocation case
@@ -692,7 +1528,13 @@ void lr_free(void* ptr) noexcept
             UnregisterDesc(nullptr, (char*)ptr);
 
         // free superblock
-        PageFree(superblock, desc->blockSize);
+        if (desc->run)
+            RunFree(desc->run, superblock, desc->blockSize);
+        else
+            ReleasePagesDirect(superblock, desc->blockSize);
+
+        FetchSub(ActiveBytes, desc->blockSize, MO_RELAXED);
+
         RemoveEmptyDesc(heap, desc);
 
         // desc cannot be in any partial list, so it can be
@@ -702,63 +1544,192 @@ void lr_free(void* ptr) noexcept
     }
 
     // normal case
+    uint64_t blockSize = desc->blockSize;
+    uint64_t idx = ((char*)ptr - superblock) / blockSize;
+    // recompute ptr, 
+    // @todo: remove when descriptor ptrs are no longer stored in "user" memory
+    ptr = (char*)(superblock + idx * blockSize);
+
+#if LFMALLOC_THREAD_CACHE
+    // arena blocks aren't cached
+    if (LIKELY(IsGlobalHeap(heap)))
     {
-        // after CAS, desc might become empty and
-        //  concurrently reused, so store maxcount
-        uint64_t maxcount = desc->maxcount;
-        (void)maxcount; // used in assert
+        size_t scIdx = heap - Heaps;
+        if (LIKELY(CachePush(scIdx, (char*)ptr)) ||
+                CacheOverflow(scIdx, (char*)ptr))
+            return;
+    }
+#endif
 
-        Anchor oldAnchor = desc->anchor.load();
-        Anchor newAnchor;
-        do
-        {
-            // compute index of ptr
-            uint64_t blockSize = desc->blockSize;
-            uint64_t idx = ((char*)ptr - superblock) / blockSize;
+    FreeBlock(desc, (char*)ptr);
+}
 
-            // recompute ptr, 
-            // @todo: remove when descriptor ptrs are no longer stored in "user" memory
-            ptr = (char*)(desc->superblock + idx * blockSize);
+// returns block ptr to its superblock (or free buffer)
+void FreeBlock(Descriptor* desc, char* ptr)
+{
+    uint64_t idx = (ptr - desc->superblock) / desc->blockSize;
 
-            // update anchor.avail
-            *(uint64_t*)ptr = oldAnchor.avail;
+#if LFMALLOC_FREE_BATCH
+    if (LIKELY(BufferFree(desc, idx, ptr)))
+        return;
+#endif
 
-            newAnchor = oldAnchor;
-            newAnchor.avail = idx;
-            // state updates
-            // don't set SB_PARTIAL if state == SB_ACTIVE
-            if (oldAnchor.state == SB_FULL)
-                newAnchor.state = SB_PARTIAL;
-            // this can't happen with SB_ACTIVE
-            // because of reserved blocks
-            if (oldAnchor.count == desc->maxcount - 1)
-                newAnchor.state = SB_EMPTY; // can free superblock
-            else
-                ++newAnchor.count;
-        }
-        while (!desc->anchor.compare_exchange_weak(
-                    oldAnchor, newAnchor));
+    FreeBlocks(desc, idx, ptr, 1);
+}
+
+extern "C"
+uint64_t* lr_thread_allocatedp() noexcept
+{
+    return &ThreadAllocated;
+}
+
+extern "C"
+uint64_t* lr_thread_deallocatedp() noexcept
+{
+    return &ThreadDeallocated;
+}
+
+// descriptor is live if its superblock is registered with it
+// can only be trusted if heap isn't being concurrently modified
+static bool DescIsLive(Descriptor* desc)
+{
+    char* superblock = desc->superblock;
+    return superblock && GetDescriptorForPtr(superblock) == desc;
+}
+
+static void DescGetInfo(Descriptor* desc, lr_sb_info* info)
+{
+    // a snapshot, see DescIsLive
+    ProcHeap* heap = desc->heap;
+    Anchor anchor = desc->anchor.load(MO_RELAXED);
+
+    info->start = desc->superblock;
+    info->block_size = desc->blockSize;
+    info->max_count = desc->maxcount;
+    info->state = anchor.state;
+    info->handle = desc;
+    if (heap)
+    {
+        info->size = heap->sizeclass->sbSize;
+        info->size_class = heap->sizeclass - SizeClasses;
+        info->free_count = anchor.count;
+        // blocks reserved for the active superblock are free as well
+        Descriptor* active = nullptr;
+        uint64_t credits = 0;
+        GetActive(heap->active.load(MO_RELAXED), &active, &credits);
+        if (anchor.state == SB_ACTIVE && active == desc)
+            info->free_count += credits + 1;
+    }
+    else
+    {
+        // large allocation, single block
+        info->size = desc->blockSize;
+        info->size_class = 0;
+        info->free_count = 0;
+    }
+}
 
-        // after last CAS, can't reliably read any desc fields
-        // as desc might have become empty and been concurrently reused
-        ASSERT(oldAnchor.avail < maxcount || oldAnchor.state == SB_FULL);
-        ASSERT(newAnchor.avail < maxcount);
-        ASSERT(newAnchor.count < maxcount);
+static void SumLive(lr_sb_info const* info, void* arg)
+{
+    size_t* live = (size_t*)arg;
+    *live += (info->max_count - info->free_count) * info->block_size;
+}
 
-        // CAS success, can free block
-        if (newAnchor.state == SB_EMPTY)
+extern "C"
+void lr_memory_stats(lr_mem_stats* stats, int walk) noexcept
+{
+    // heap walk maps and frees pages, so it must come first
+    stats->live = 0;
+    if (walk)
+        lr_heap_walk(SumLive, &stats->live);
+
+    stats->mapped = PagesMapped.load(MO_RELAXED);
+    stats->released = PagesReleased.load(MO_RELAXED);
+    stats->active = ActiveBytes.load(MO_RELAXED);
+
+    // counters are updated independently, clamp if a concurrent update
+    //  was only partially observed
+    size_t metaMapped = PagesMetadata.load(MO_RELAXED);
+    size_t used = stats->released + stats->active + metaMapped;
+    stats->retained = (stats->mapped > used) ? stats->mapped - used : 0;
+
+    stats->metadata = metaMapped + sPageMap.GetTouchedBytes() +
+        sizeof(SizeClasses) + sizeof(SizeClassLookup) + sizeof(Heaps);
+}
+
+extern "C"
+void lr_heap_walk(lr_heap_walk_fn fn, void* arg) noexcept
+{
+    // blocks cached/buffered by this thread are reported as free
+    lr_thread_cache_flush();
+
+    // acquire, see DescBlockRegister
+    DescriptorBlock* block = DescBlocks.load(MO_ACQUIRE);
+    for (; block; block = block->next)
+    {
+        char* ptr = (char*)block;
+        // skip block header, see DescAlloc
+        char* currPtr = ptr + sizeof(Descriptor);
+        for (; currPtr + sizeof(Descriptor) < ptr + DESCRIPTOR_BLOCK_SZ;
+                currPtr += sizeof(Descriptor))
         {
-            // unregister descriptor
-            UnregisterDesc(heap, superblock);
+            Descriptor* desc = (Descriptor*)currPtr;
+            if (!DescIsLive(desc))
+                continue;
 
-            // free superblock
-            PageFree(superblock, heap->sizeclass->sbSize);
-            RemoveEmptyDesc(heap, desc);
+            lr_sb_info info;
+            DescGetInfo(desc, &info);
+            fn(&info, arg);
         }
-        else if (oldAnchor.state == SB_FULL)
-            HeapPushPartial(desc);
     }
 }
 
+extern "C"
+size_t lr_heap_walk_blocks(lr_sb_info const* info, lr_block_walk_fn fn,
+        void* arg) noexcept
+{
+    Descriptor* desc = (Descriptor*)info->handle;
+    if (!DescIsLive(desc))
+        return 0;
+
+    // large allocation
+    if (!desc->heap)
+    {
+        fn(desc->superblock, desc->blockSize, arg);
+        return 1;
+    }
+
+    // mark free blocks by following the avail chain
+    // no terminator, chain length is the number of free blocks
+    uint64_t maxcount = desc->maxcount;
+    uint64_t blockSize = desc->blockSize;
+    size_t bitmapSz = PAGE_CEILING((maxcount + 7) / 8);
+    uint8_t* isFree = (uint8_t*)PageAlloc(bitmapSz);
+    if (!isFree)
+        return 0;
 
+    // acquire, links are followed
+    Anchor anchor = desc->anchor.load(MO_ACQUIRE);
+    uint64_t idx = anchor.avail;
+    for (uint64_t n = 0; n < info->free_count && idx < maxcount; ++n)
+    {
+        if (isFree[idx / 8] & (1 << (idx % 8)))
+            break; // concurrently modified
 
+        isFree[idx / 8] |= (1 << (idx % 8));
+        idx = *(uint64_t*)(desc->superblock + idx * blockSize);
+    }
+
+    size_t count = 0;
+    for (idx = 0; idx < maxcount; ++idx)
+    {
+        if (isFree[idx / 8] & (1 << (idx % 8)))
+            continue;
+
+        fn(desc->superblock + idx * blockSize, blockSize, arg);
+        ++count;
+    }
+
+    PageFree(isFree, bitmapSz);
+    return count;
+}
@@ -3,14 +3,18 @@
 #define __LFMALLOC_H
 
 #include <atomic>
+#include <cstddef>
 
 #include "defines.h"
+#include "size_classes.h"
 
 #define LFMALLOC_ATTR(s) __attribute__((s))
 #define LFMALLOC_ALLOC_SIZE(s) LFMALLOC_ATTR(alloc_size(s))
 #define LFMALLOC_ALLOC_SIZE2(s1, s2) LFMALLOC_ATTR(alloc_size(s1, s2))
 #define LFMALLOC_EXPORT LFMALLOC_ATTR(visibility("default"))
 #define LFMALLOC_NOTHROW LFMALLOC_ATTR(nothrow)
+// lrmichael.so is usually LD_PRELOAD'ed, so static tls is always available
+#define LFMALLOC_TLS LFMALLOC_ATTR(tls_model("initial-exec"))
 
 #define STATIC_ASSERT(x, m) static_assert(x, m)
 
@@ -59,6 +63,118 @@ extern "C"
         LFMALLOC_EXPORT LFMALLOC_NOTHROW LFMALLOC_ALLOC_SIZE(2);
     void* lr_pvalloc(size_t size) noexcept
         LFMALLOC_EXPORT LFMALLOC_NOTHROW LFMALLOC_ALLOC_SIZE(1);
+    // allocates n blocks of size bytes into out
+    // returns number of blocks allocated, < n only if out of memory
+    size_t lr_malloc_batch(size_t size, size_t n, void** out) noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW LFMALLOC_ATTR(nonnull(3));
+    // per-thread statistics
+    // pointers to the calling thread's cumulative allocated/deallocated
+    //  bytes (in block sizes), can be kept and read with a plain load
+    uint64_t* lr_thread_allocatedp() noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
+    uint64_t* lr_thread_deallocatedp() noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
+
+    // thread cache
+    // state of a size class bin of the calling thread's cache
+    struct lr_cache_bin_stats
+    {
+        size_t block_size;
+        // cached blocks
+        size_t count;
+        // current (self-tuned) capacity
+        size_t max;
+        // cumulative number of refills/flushes
+        size_t refills;
+        size_t flushes;
+    };
+
+    // fills stats for up to n size classes, starting at the first
+    // returns number of entries written, 0 if thread cache is disabled
+    size_t lr_thread_cache_stats(lr_cache_bin_stats* stats, size_t n) noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
+    // returns all blocks cached by the calling thread, and the frees it
+    //  buffered, to their superblocks
+    // useful before a thread goes idle for a long time, as caches are
+    //  only trimmed by the thread's own allocations
+    void lr_thread_cache_flush() noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
+
+    // arenas
+    // an arena has its own set of heaps, so its blocks never share
+    //  superblocks with blocks from other arenas or from lr_malloc
+    // blocks are free'd with lr_free, arenas are never destroyed
+    struct lr_arena;
+    lr_arena* lr_arena_create() noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
+    void* lr_arena_malloc(lr_arena* arena, size_t size) noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW LFMALLOC_ALLOC_SIZE(2);
+
+    // heap walking
+    // superblock description, large allocations are a single block
+    struct lr_sb_info
+    {
+        // first block
+        void* start;
+        // superblock size in bytes
+        size_t size;
+        size_t block_size;
+        // 0 for large allocations
+        size_t size_class;
+        // number of blocks
+        size_t max_count;
+        // number of free blocks
+        size_t free_count;
+        // see SuperblockState
+        int state;
+        // used by lr_heap_walk_blocks
+        void const* handle;
+    };
+
+    typedef void (*lr_heap_walk_fn)(lr_sb_info const* info, void* arg);
+    typedef void (*lr_block_walk_fn)(void* block, size_t size, void* arg);
+
+    // calls fn for each live superblock and large allocation
+    // results are only exact if other threads aren't using the heap,
+    //  and blocks in other threads' caches and free buffers count as
+    //  allocated
+    void lr_heap_walk(lr_heap_walk_fn fn, void* arg) noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
+    // calls fn for each allocated block of superblock described by info
+    // must be called from fn during lr_heap_walk
+    // returns number of allocated blocks
+    size_t lr_heap_walk_blocks(lr_sb_info const* info, lr_block_walk_fn fn,
+            void* arg) noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
+
+    // memory accounting, in bytes
+    // resident memory is roughly mapped - released, plus the metadata
+    //  that isn't mapped through the page allocator (pagemap, tables)
+    struct lr_mem_stats
+    {
+        // mapped from the OS, excluding the (overcommitted) pagemap
+        size_t mapped;
+        // mapped but without physical memory (given back, or never used)
+        size_t released;
+        // superblocks owned by heaps and large allocations
+        size_t active;
+        // allocated blocks, only computed if requested, see below
+        size_t live;
+        // kept for reuse: pooled empty superblocks, free pages of run
+        //  superblocks that weren't released (see runs.h), pages waiting
+        //  for the reclaimer
+        size_t retained;
+        // descriptor blocks, run superblock headers, arenas, touched
+        //  pagemap pages and size class/heap tables
+        size_t metadata;
+    };
+
+    // counters are updated on page and superblock transitions, so
+    //  reading them is cheap
+    // if walk isn't 0, live is computed with lr_heap_walk, which takes
+    //  time proportional to the number of superblocks, otherwise it's 0
+    void lr_memory_stats(lr_mem_stats* stats, int walk) noexcept
+        LFMALLOC_EXPORT LFMALLOC_NOTHROW;
 }
 
 // superblock states
@@ -80,6 +196,7 @@ struct DescriptorNode;
 struct Descriptor;
 struct ProcHeap;
 struct SizeClassData;
+struct RunSuperblock;
 
 // helper struct to fill descriptor_t::anchor
 // used as atomic_uint64_t
@@ -120,6 +237,10 @@ struct Descriptor
     ProcHeap* heap;
     uint64_t blockSize; // block size
     uint64_t maxcount;
+    // for medium allocations (heap == nullptr), run superblock
+    //  the allocation was carved from
+    // nullptr for large allocations and size class superblocks
+    RunSuperblock* run;
 } LFMALLOC_ATTR(aligned(CACHELINE));
 
 /*
@@ -137,6 +258,10 @@ typedef Descriptor ActiveDescriptor;
 #define CREDITS_MAX (1ULL << 6)
 #define CREDITS_MASK ((1ULL << 6) - 1)
 
+// partial superblocks are kept in lists by fullness, see PartialBucket
+// bucket 0 holds >75% used superblocks, 1 holds 25-75%, 2 holds <25%
+#define PARTIAL_BUCKETS 3
+
 // at least one ProcHeap instance exists for each sizeclass
 struct ProcHeap
 {
@@ -144,33 +269,192 @@ struct ProcHeap
     // aligned to 64 bytes, last 6 bits used for credits
     // see ActiveDescriptor
     std::atomic<ActiveDescriptor*> active;
-    // ptr to descriptor, head of partial descriptor list
-    std::atomic<DescriptorNode> partialList;
+    // ptr to descriptor, heads of partial descriptor lists
+    // allocation prefers fuller superblocks, so that mostly empty
+    //  superblocks can drain and be released
+    std::atomic<DescriptorNode> partialList[PARTIAL_BUCKETS];
 
     SizeClassData* sizeclass;
 } LFMALLOC_ATTR(aligned(CACHELINE));
 
+struct lr_arena
+{
+    ProcHeap heaps[MAX_SZ_IDX];
+};
+
+// max number of empty superblocks kept for reuse, see SuperblockFree
+// 64MB
+#ifndef SB_POOL_MAX
+#define SB_POOL_MAX 32
+#endif
+
+// empty superblock in pool, link is stored in the superblock itself
+struct EmptySuperblock
+{
+    EmptySuperblock* next;
+};
+
+// used with double-cas for atomic ops
+struct EmptySuperblockNode
+{
+    EmptySuperblock* sb;
+    // aba counter
+    uint64_t counter;
+};
+
 // size of allocated block when allocating descriptors
 // block is split into multiple descriptors
 // 64k byte blocks
 #define DESCRIPTOR_BLOCK_SZ (16 * PAGE)
 
+// if 1, blocks freed by a thread are buffered per descriptor and
+//  returned to their superblock with a single anchor CAS
+#ifndef LFMALLOC_FREE_BATCH
+#define LFMALLOC_FREE_BATCH 1
+#endif
+
+// number of descriptors a thread buffers frees for
+#define FREE_BUFFER_NUM 8
+// a buffer is flushed when it holds this many blocks
+#define FREE_BUFFER_MAX 32
+// time bound, all buffers are flushed every this many lr_free calls
+#define FREE_BUFFER_FLUSH_OPS 1024
+
+// blocks freed by this thread that belong to desc
+// chained through their first 8 bytes, like anchor.avail
+struct FreeBuffer
+{
+    Descriptor* desc;
+    // idx of first block in chain
+    uint64_t head;
+    // last block in chain, linked to anchor.avail on flush
+    char* tail;
+    uint64_t count;
+};
+
+struct ThreadFreeBuffers
+{
+    FreeBuffer buffers[FREE_BUFFER_NUM];
+    // lr_free calls since last flush
+    uint64_t ops;
+    // next buffer to evict when all are in use
+    uint64_t victim;
+    // thread exit destructor registered
+    bool registered;
+    // thread is exiting, buffers can't be used anymore
+    bool finalized;
+};
+
+// if 1, each thread caches blocks of the global heaps per size class
+// cache capacity is tuned per size class, see CacheRefill/CacheOverflow
+//  and CacheGC
+// opt-in, build with make CPPFLAGS=-DLFMALLOC_THREAD_CACHE=1
+// caveats:
+// - gc is driven by the thread's own cache ops, an idle thread keeps its
+//  cached blocks (up to CACHE_BIN_BYTES per size class) until it calls
+//  lr_thread_cache_flush or exits
+// - blocks are cached instead of going through the free buffers, so
+//  frees of blocks allocated by other threads aren't batched
+#ifndef LFMALLOC_THREAD_CACHE
+#define LFMALLOC_THREAD_CACHE 0
+#endif
+
+// bounds of a bin's capacity, in blocks
+#define CACHE_BIN_MIN 2
+#define CACHE_BIN_MAX 256
+// a bin's capacity is also bounded by this many bytes
+#define CACHE_BIN_BYTES (64 * 1024)
+// initial capacity
+#define CACHE_BIN_INIT 8
+// garbage collection runs every this many cache ops
+#define CACHE_GC_OPS 8192
+
+// cached blocks of a size class
+// chained through their first 8 bytes
+struct CacheBin
+{
+    char* head;
+    uint32_t count;
+    // capacity, 0 if bin wasn't used yet
+    uint32_t max;
+    // min count since last gc, blocks that weren't needed
+    uint32_t lowWater;
+    // refilled since last flush
+    bool refilled;
+    // stats
+    uint64_t refills;
+    uint64_t flushes;
+};
+
+struct ThreadCache
+{
+    CacheBin bins[MAX_SZ_IDX];
+    // cache ops since last gc
+    uint64_t ops;
+    // thread exit destructor registered
+    bool registered;
+    // thread is exiting, cache can't be used anymore
+    bool finalized;
+};
+
+// header of a block of descriptors
+// uses the first descriptor slot
+struct DescriptorBlock
+{
+    DescriptorBlock* next;
+};
+
+STATIC_ASSERT(sizeof(DescriptorBlock) <= sizeof(Descriptor),
+        "Invalid descriptor block header size");
+
 // global variables
 // descriptor recycle list
 extern std::atomic<DescriptorNode> AvailDesc;
+// all descriptor blocks, push-only
+extern std::atomic<DescriptorBlock*> DescBlocks;
+// empty superblocks, see SuperblockAlloc
+extern std::atomic<EmptySuperblockNode> EmptySbs;
+extern std::atomic<uint64_t> EmptySbCount;
+// see lr_memory_stats
+extern std::atomic<size_t> ActiveBytes;
+// thread cache, see CachePop/CachePush in lrmichael_inline.h
+extern __thread ThreadCache TCache LFMALLOC_TLS;
+// per-thread cumulative allocated/deallocated bytes
+extern __thread uint64_t ThreadAllocated LFMALLOC_TLS;
+extern __thread uint64_t ThreadDeallocated LFMALLOC_TLS;
 
 // helper fns
-void* MallocFromActive(ProcHeap* heap);
+// MallocFromActive() is defined in lrmichael_inline.h
 void UpdateActive(ProcHeap* heap, Descriptor* desc, uint64_t credits);
+void* SuperblockAlloc();
+void SuperblockFree(void* sb);
 void HeapPushPartial(Descriptor* desc);
 Descriptor* HeapPopPartial(ProcHeap* heap);
 void* MallocFromPartial(ProcHeap* heap);
-void* MallocFromNewSB(ProcHeap* heap);
+void* MallocFromNewSB(ProcHeap* heap, bool* oom);
 void RemoveEmptyDesc(ProcHeap* heap, Descriptor* desc);
+Descriptor* GetDescriptorForPtr(void* ptr);
+void FreeBlocks(Descriptor* desc, uint64_t head, char* tail, uint64_t count);
+bool BufferFree(Descriptor* desc, uint64_t idx, char* ptr);
+bool FlushFreeBuffers();
+void FreeBlock(Descriptor* desc, char* ptr);
+size_t MallocBatch(ProcHeap* heap, size_t n, void** out);
+void* CacheRefill(ProcHeap* heap);
+bool CacheOverflow(size_t scIdx, char* ptr);
+void CacheFlush(CacheBin& bin, uint64_t n);
+void CacheGC();
+void DescBlockRegister(DescriptorBlock* block);
 Descriptor* DescAlloc();
 void DescRetire(Descriptor* desc);
 
+void InitHeaps(ProcHeap* heaps);
 ProcHeap* GetProcHeap(size_t size);
+void* MallocLarge(size_t size);
+void* MallocFromHeap(ProcHeap* heap);
+bool WalkBlocks(Descriptor* desc, uint64_t avail, uint64_t n, void** out,
+        uint64_t* next);
+size_t MallocBatchFromActive(ProcHeap* heap, size_t n, void** out);
+size_t MallocBatchFromPartial(ProcHeap* heap, size_t n, void** out);
 
 #endif // __LFMALLOC_H
 
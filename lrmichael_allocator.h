@@ -0,0 +1,154 @@
+
+#ifndef __LFMALLOC_ALLOCATOR_H
+#define __LFMALLOC_ALLOCATOR_H
+
+// standard allocator, for statically linked applications that want
+//  containers on lrmichael without replacing malloc
+// single element allocations (e.g list/map/unordered_map nodes) go
+//  through lr::object_pool, so their size class is known at compile time
+// optionally bound to an arena, see lr_arena_create()
+// instances compare equal if they use the same arena, and propagate with
+//  containers, so containers never take over memory of another arena
+//
+// usage:
+//  std::vector<int, lr::allocator<int>> v;
+//  lr::allocator<int> alloc(lr_arena_create());
+//  std::map<int, int, std::less<int>,
+//      lr::allocator<std::pair<int const, int>>> m(std::less<int>(), alloc);
+
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+#include "lrmichael_pool.h"
+
+namespace lr
+{
+
+template<typename T>
+class allocator
+{
+public:
+    typedef T value_type;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    typedef std::false_type is_always_equal;
+
+    template<typename U>
+    struct rebind
+    {
+        typedef allocator<U> other;
+    };
+
+    allocator() noexcept : _arena(nullptr) { }
+    explicit allocator(lr_arena* arena) noexcept : _arena(arena) { }
+
+    template<typename U>
+    allocator(allocator<U> const& other) noexcept : _arena(other.arena()) { }
+
+    T* allocate(size_t n)
+    {
+        void* ptr = nullptr;
+        if (n == 1)
+            ptr = AllocateOne(UsePool());
+        else if (n <= std::numeric_limits<size_t>::max() / sizeof(T))
+            ptr = AllocateN(n * sizeof(T));
+
+        if (UNLIKELY(!ptr))
+            ThrowBadAlloc();
+
+        return (T*)ptr;
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept
+    {
+        if (n == 1)
+        {
+            DeallocateOne(ptr, UsePool());
+            return;
+        }
+
+        // size is known, skip lr_free's lookups like object_pool does
+        // (allocate checked that it doesn't overflow)
+        size_t scIdx = GetSizeClass(n * sizeof(T));
+        if (alignof(T) > 16 || !scIdx)
+        {
+            lr_free(ptr);
+            return;
+        }
+
+        FreeSmall(ptr, SizeClasses[scIdx].blockSize);
+    }
+
+    lr_arena* arena() const noexcept { return _arena; }
+
+private:
+    // types that don't fit a size class or its alignment use lr_malloc
+    typedef std::integral_constant<bool,
+            (sizeof(T) < MAX_SZ && alignof(T) <= 16)> UsePool;
+
+    void* AllocateOne(std::true_type) const
+    {
+        return object_pool<T>::allocate(_arena);
+    }
+
+    void* AllocateOne(std::false_type) const
+    {
+        return AllocateN(sizeof(T));
+    }
+
+    void* AllocateN(size_t size) const
+    {
+        if (alignof(T) > 16)
+            return lr_aligned_alloc(alignof(T), size);
+
+        if (_arena)
+            return lr_arena_malloc(_arena, size);
+
+        return lr_malloc(size);
+    }
+
+    static void DeallocateOne(T* ptr, std::true_type)
+    {
+        object_pool<T>::deallocate(ptr);
+    }
+
+    static void DeallocateOne(T* ptr, std::false_type)
+    {
+        lr_free(ptr);
+    }
+
+    static void ThrowBadAlloc()
+    {
+#if __cpp_exceptions
+        throw std::bad_alloc();
+#else
+        abort();
+#endif
+    }
+
+private:
+    lr_arena* _arena;
+};
+
+template<typename T, typename U>
+inline bool operator==(allocator<T> const& lhs, allocator<U> const& rhs)
+    noexcept
+{
+    return lhs.arena() == rhs.arena();
+}
+
+template<typename T, typename U>
+inline bool operator!=(allocator<T> const& lhs, allocator<U> const& rhs)
+    noexcept
+{
+    return !(lhs == rhs);
+}
+
+} // namespace lr
+
+#endif // __LFMALLOC_ALLOCATOR_H
@@ -0,0 +1,232 @@
+
+#ifndef __LFMALLOC_INLINE_H
+#define __LFMALLOC_INLINE_H
+
+// allocation fast path, shared by lrmichael and by applications that
+//  statically link lrmichael.a and want to inline it into callers
+//  (skipping the PLT call to malloc and symbol interposition)
+// works with -flto, but doesn't require it
+
+#include <algorithm>
+
+#include "lrmichael.h"
+#include "size_classes.h"
+#include "single_thread.h"
+#include "log.h"
+
+extern ProcHeap Heaps[MAX_SZ_IDX];
+
+// utilities
+inline ActiveDescriptor* MakeActive(Descriptor* desc, uint64_t credits)
+{
+    ASSERT(((uint64_t)desc & CREDITS_MASK) == 0);
+    ASSERT(credits < CREDITS_MAX);
+
+    ActiveDescriptor* active = (ActiveDescriptor*)
+        ((uint64_t)desc | credits);
+    return active;
+}
+
+inline void GetActive(ActiveDescriptor* active, Descriptor** desc, uint64_t* credits)
+{
+    if (desc)
+        *desc = (Descriptor*)((uint64_t)active & ~CREDITS_MASK);
+
+    if (credits)
+        *credits = (uint64_t)active & CREDITS_MASK;
+}
+
+inline void* MallocFromActive(ProcHeap* heap)
+{
+    // reserve block
+    // desc isn't read until the CAS succeeds, which acquires it (see
+    //  UpdateActive/MallocFromNewSB)
+    ActiveDescriptor* oldActive = heap->active.load(MO_RELAXED);
+    ActiveDescriptor* newActive;
+    uint64_t oldCredits;
+    do
+    {
+        if (!oldActive)
+            return nullptr;
+
+        Descriptor* oldDesc;
+        GetActive(oldActive, &oldDesc, &oldCredits);
+
+        // if credits > 0, subtract by 1
+        // otherwise set newActive to nullptr
+        newActive = nullptr;
+        if (oldCredits > 0)
+            newActive = MakeActive(oldDesc, oldCredits - 1);
+
+        STRESS_POINT();
+    } while (!CasWeak(heap->active,
+            oldActive, newActive, MO_ACQUIRE, MO_RELAXED));
+
+    Descriptor* desc = (Descriptor*)((uint64_t)oldActive & ~CREDITS_MASK);
+
+    LOG_DEBUG("Heap %p, Desc %p", heap, desc);
+
+    // pop block (that we assert exists)
+    // underlying superblock *CANNOT* change after
+    // block reservation, it'll never be empty until we use it
+    char* ptr = nullptr;
+    uint64_t credits = 0;
+
+    // anchor state *CANNOT* be empty
+    // there is at least one reserved block
+    // acquire, to read the link written by the free that pushed avail
+    //  (frees release, see FreeBlocks)
+    Anchor oldAnchor = desc->anchor.load(MO_ACQUIRE);
+    Anchor newAnchor;
+    do
+    {
+        ASSERT(oldAnchor.avail < desc->maxcount);
+
+        // compute available block
+        uint64_t blockSize = desc->blockSize;
+        uint64_t avail = oldAnchor.avail;
+        uint64_t offset = avail * blockSize;
+        ptr = (desc->superblock + offset);
+
+        // @todo: synchronize this access
+        uint64_t next = *(uint64_t*)ptr;
+
+        newAnchor = oldAnchor;
+        newAnchor.avail = next;
+        newAnchor.tag++;
+        // last available block
+        if (oldCredits == 0)
+        {
+            // superblock is completely used up
+            if (oldAnchor.count == 0)
+                newAnchor.state = SB_FULL;
+            else
+            {
+                // otherwise, fill up credits
+                credits = std::min<uint64_t>(oldAnchor.count, CREDITS_MAX);
+                newAnchor.count -= credits;
+            }
+        }
+        STRESS_POINT();
+    }
+    while (!CasWeak(desc->anchor,
+                oldAnchor, newAnchor, MO_ACQUIRE, MO_ACQUIRE));
+
+    // can safely read desc fields after CAS, since desc cannot become empty
+    //  until after this fn returns block
+    // SB_FULL only means there are no unreserved blocks left, the last
+    //  reservation to be popped (not necessarily the last credit) reads
+    //  the garbage link at the end of the chain
+    ASSERT(newAnchor.avail < desc->maxcount || newAnchor.state == SB_FULL);
+
+    // credits change, update
+    // while credits == 0, active is nullptr
+    // meaning allocations *CANNOT* come from an active block
+    if (credits > 0)
+        UpdateActive(heap, desc, credits);
+
+    LOG_DEBUG("Heap %p, Desc %p, ptr %p", heap, desc, ptr);
+
+    return (void*)ptr;
+}
+
+inline bool IsGlobalHeap(ProcHeap* heap)
+{
+    return heap >= Heaps && heap < Heaps + MAX_SZ_IDX;
+}
+
+#if LFMALLOC_THREAD_CACHE
+// pops a block from the calling thread's cache bin for size class scIdx
+// returns nullptr if bin is empty
+inline void* CachePop(size_t scIdx)
+{
+    CacheBin& bin = TCache.bins[scIdx];
+    char* ptr = bin.head;
+    if (UNLIKELY(!ptr))
+        return nullptr;
+
+    bin.head = *(char**)ptr;
+    if (--bin.count < bin.lowWater)
+        bin.lowWater = bin.count;
+
+    if (UNLIKELY(++TCache.ops >= CACHE_GC_OPS))
+        CacheGC();
+
+    return ptr;
+}
+
+// pushes block ptr of size class scIdx to the calling thread's cache
+// returns false if bin is full, see CacheOverflow
+inline bool CachePush(size_t scIdx, char* ptr)
+{
+    CacheBin& bin = TCache.bins[scIdx];
+    if (UNLIKELY(bin.count >= bin.max))
+        return false;
+
+    *(char**)ptr = bin.head;
+    bin.head = ptr;
+    bin.count++;
+
+    if (UNLIKELY(++TCache.ops >= CACHE_GC_OPS))
+        CacheGC();
+
+    return true;
+}
+#endif
+
+// frees ptr, known to be a block (start) of a size class with blockSize
+// skips the large allocation checks of lr_free, and if blockSize is
+//  a compile time constant, the division
+inline void FreeSmall(void* ptr, size_t blockSize)
+{
+    Descriptor* desc = GetDescriptorForPtr(ptr);
+    ASSERT(desc && desc->blockSize == blockSize);
+
+    ThreadDeallocated += blockSize;
+
+#if LFMALLOC_THREAD_CACHE
+    if (LIKELY(IsGlobalHeap(desc->heap)))
+    {
+        size_t scIdx = desc->heap - Heaps;
+        if (LIKELY(CachePush(scIdx, (char*)ptr)) ||
+                CacheOverflow(scIdx, (char*)ptr))
+            return;
+    }
+#endif
+
+    uint64_t idx = ((char*)ptr - desc->superblock) / blockSize;
+
+#if LFMALLOC_FREE_BATCH
+    if (LIKELY(BufferFree(desc, idx, (char*)ptr)))
+        return;
+#endif
+
+    FreeBlocks(desc, idx, (char*)ptr, 1);
+}
+
+// size class lookup + thread cache pop (or MallocFromActive, without
+//  thread cache), falls back to lr_malloc
+static inline void* lr_malloc_inline(size_t size)
+{
+    if (LIKELY(size < MAX_SZ))
+    {
+        // before InitMalloc(), lookup yields idx 0, whose bin is always
+        //  empty and whose heap never has an active superblock, so we
+        //  fall back to lr_malloc
+        size_t scIdx = SizeClassLookup[size];
+#if LFMALLOC_THREAD_CACHE
+        void* ptr = CachePop(scIdx);
+#else
+        void* ptr = MallocFromActive(&Heaps[scIdx]);
+#endif
+        if (ptr)
+        {
+            ThreadAllocated += SizeClasses[scIdx].blockSize;
+            return ptr;
+        }
+    }
+
+    return lr_malloc(size);
+}
+
+#endif // __LFMALLOC_INLINE_H
@@ -0,0 +1,125 @@
+
+#ifndef __LFMALLOC_POOL_H
+#define __LFMALLOC_POOL_H
+
+// typed allocation for fixed-size objects, for statically linked
+//  applications (like lrmichael_inline.h)
+// the size class of T is computed at compile time, so allocation skips
+//  the size class lookup and free divides by a constant block size
+// objects are regular blocks, they can be free'd with lr_free and blocks
+//  from lr_malloc(sizeof(T)) can be released by the pool
+//
+// usage:
+//  Node* node = lr::new_object<Node>(key, value);
+//  lr::delete_object(node);
+
+#include <new>
+#include <utility>
+
+#include "lrmichael_inline.h"
+
+namespace lr
+{
+
+template<typename T>
+class object_pool
+{
+public:
+    static_assert(sizeof(T) < MAX_SZ, "Type too large for a size class");
+    // blocks are only guaranteed to be 16 byte aligned
+    //  (or smaller, for smaller blocks)
+    static_assert(alignof(T) <= 16, "Over-aligned types are not supported");
+
+    static constexpr size_t sizeClass = GetSizeClassStatic(sizeof(T));
+    static constexpr size_t blockSize = SizeClassBlockSizes[sizeClass];
+
+    // returns uninitialized memory for a T, nullptr on failure
+    // allocates from arena's heaps if arena isn't nullptr
+    static void* allocate(lr_arena* arena = nullptr)
+    {
+        // before InitMalloc(), heap has no active superblock, so we
+        //  fall back to lr_malloc
+        ProcHeap* heap = arena ?
+            &arena->heaps[sizeClass] : &Heaps[sizeClass];
+#if LFMALLOC_THREAD_CACHE
+        // thread cache only holds blocks from global heaps
+        // lr_malloc refills it
+        if (!arena)
+        {
+            if (void* ptr = CachePop(sizeClass))
+            {
+                ThreadAllocated += blockSize;
+                return ptr;
+            }
+
+            return lr_malloc(sizeof(T));
+        }
+#endif
+        if (void* ptr = MallocFromActive(heap))
+        {
+            ThreadAllocated += blockSize;
+            return ptr;
+        }
+
+        if (arena)
+            return MallocFromHeap(heap);
+
+        return lr_malloc(sizeof(T));
+    }
+
+    // ptr must be a block of T's size class
+    static void deallocate(void* ptr)
+    {
+        if (UNLIKELY(!ptr))
+            return;
+
+        FreeSmall(ptr, blockSize);
+    }
+
+    template<typename... Args>
+    static T* create(Args&&... args)
+    {
+        void* ptr = allocate();
+        if (UNLIKELY(!ptr))
+            return nullptr;
+
+#if __cpp_exceptions
+        try
+        {
+            return new (ptr) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            deallocate(ptr);
+            throw;
+        }
+#else
+        return new (ptr) T(std::forward<Args>(args)...);
+#endif
+    }
+
+    static void destroy(T* obj)
+    {
+        if (UNLIKELY(!obj))
+            return;
+
+        obj->~T();
+        deallocate(obj);
+    }
+};
+
+template<typename T, typename... Args>
+inline T* new_object(Args&&... args)
+{
+    return object_pool<T>::create(std::forward<Args>(args)...);
+}
+
+template<typename T>
+inline void delete_object(T* obj)
+{
+    object_pool<T>::destroy(obj);
+}
+
+} // namespace lr
+
+#endif // __LFMALLOC_POOL_H
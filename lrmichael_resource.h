@@ -0,0 +1,120 @@
+
+#ifndef __LFMALLOC_RESOURCE_H
+#define __LFMALLOC_RESOURCE_H
+
+// std::pmr::memory_resource backed by lrmichael, requires C++17
+// lr::memory_resource allocates from the global heaps, or from an arena
+//  (see lr_arena_create()) if one is given
+// two resources are equal if they use the same arena, containers then
+//  only take over each other's memory within an arena
+// alignments above 16 are met by over-allocating, within the arena if
+//  there's one (large allocations never come from an arena, as with
+//  lr_arena_malloc)
+//
+// usage:
+//  lr::memory_resource resource(lr_arena_create());
+//  std::pmr::vector<int> v(&resource);
+
+#if defined(__has_include)
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#define LFMALLOC_HAS_PMR 1
+#endif
+#endif
+
+#if LFMALLOC_HAS_PMR
+
+#include <memory_resource>
+#include <new>
+
+#include "lrmichael_inline.h"
+
+namespace lr
+{
+
+class memory_resource : public std::pmr::memory_resource
+{
+public:
+    memory_resource() noexcept : _arena(nullptr) { }
+    explicit memory_resource(lr_arena* arena) noexcept : _arena(arena) { }
+
+    lr_arena* arena() const noexcept { return _arena; }
+
+protected:
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+        bytes = AlignSize(bytes, alignment);
+        void* ptr = nullptr;
+        if (alignment > 16 && _arena && bytes + alignment < MAX_SZ)
+        {
+            // like lr_aligned_alloc, blocks can be free'd from any address
+            //  inside them
+            char* block = (char*)lr_arena_malloc(_arena, bytes + alignment);
+            if (block)
+                ptr = ALIGN_ADDR(block, alignment);
+        }
+        else if (alignment > 16)
+            ptr = lr_aligned_alloc(alignment, bytes);
+        else if (_arena)
+            ptr = lr_arena_malloc(_arena, bytes);
+        else
+            ptr = lr_malloc(bytes);
+
+        if (UNLIKELY(!ptr))
+            throw std::bad_alloc();
+
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override
+    {
+        // aligned blocks might not start at the block start, and large
+        //  allocations have no size class
+        size_t scIdx = GetSizeClass(AlignSize(bytes, alignment));
+        if (alignment > 16 || !scIdx)
+        {
+            lr_free(ptr);
+            return;
+        }
+
+        FreeSmall(ptr, SizeClasses[scIdx].blockSize);
+    }
+
+    bool do_is_equal(std::pmr::memory_resource const& other)
+        const noexcept override
+    {
+        if (this == &other)
+            return true;
+
+        memory_resource const* resource =
+            dynamic_cast<memory_resource const*>(&other);
+        return resource && resource->_arena == _arena;
+    }
+
+private:
+    // a size class's blocks are only aligned to the largest power of two
+    //  (up to 16) dividing their size, e.g 24 byte blocks to 8, so sizes
+    //  are rounded up to the alignment, which both functions must agree on
+    // 0 bytes is rounded up too, the 8 byte class isn't 16 aligned
+    static size_t AlignSize(size_t bytes, size_t alignment) noexcept
+    {
+        if (bytes < alignment)
+            return alignment;
+
+        return (bytes + alignment - 1) & ~(alignment - 1);
+    }
+
+    lr_arena* _arena;
+};
+
+// resource for the global heaps
+inline memory_resource* global_resource() noexcept
+{
+    static memory_resource resource;
+    return &resource;
+}
+
+} // namespace lr
+
+#endif // LFMALLOC_HAS_PMR
+
+#endif // __LFMALLOC_RESOURCE_H
@@ -15,4 +15,6 @@ void PageMap::Init()
     // PM_SZ is necessarily aligned to page size
     _pagemap = (std::atomic<PageInfo>*)PageAllocOvercommit(PM_SZ);
     ASSERT(_pagemap);
+    _touched = (std::atomic<uint64_t>*)PageAllocOvercommit(PM_TOUCHED_SZ);
+    ASSERT(_touched);
 }
@@ -35,6 +35,9 @@ struct PageInfo
 };
 
 #define PM_SZ ((1ULL << PM_SB) * sizeof(PageInfo))
+// pagemap pages are tracked in a bitmap, to account for touched ones
+#define PM_PAGES (PM_SZ / PAGE)
+#define PM_TOUCHED_SZ (PM_PAGES / 8)
 
 static_assert(sizeof(PageInfo) == sizeof(uint64_t), "Invalid PageInfo size");
 
@@ -45,15 +48,22 @@ class PageMap
 public:
     PageInfo GetPageInfo(char* ptr);
     void SetPageInfo(char* ptr, PageInfo info);
+    // bytes of pagemap pages that were written to
+    // (i.e physical memory used by the pagemap)
+    size_t GetTouchedBytes() const;
 
 private:
     void Init();
     size_t AddrToKey(char* ptr) const;
+    void Touch(size_t key);
 
 private:
     bool _init = false;
     // array based impl
     std::atomic<PageInfo>* _pagemap = { nullptr };
+    // bit set for each pagemap page that was written to, overcommitted
+    std::atomic<uint64_t>* _touched = { nullptr };
+    std::atomic<size_t> _touchedPages = { 0 };
 };
 
 inline size_t PageMap::AddrToKey(char* ptr) const
@@ -67,8 +77,12 @@ inline PageInfo PageMap::GetPageInfo(char* ptr)
     if (UNLIKELY(!_init))
         Init();
 
+    // relaxed, entries are only read for blocks owned by the caller, that
+    //  were allocated after the entry was written, and so already
+    //  synchronized with the write through the heap's atomics (or the
+    //  application, if it passed the block between threads)
     size_t key = AddrToKey(ptr);
-    return _pagemap[key].load();
+    return _pagemap[key].load(MO_RELAXED);
 }
 
 inline void PageMap::SetPageInfo(char* ptr, PageInfo info)
@@ -76,8 +90,31 @@ inline void PageMap::SetPageInfo(char* ptr, PageInfo info)
     if (UNLIKELY(!_init))
         Init();
 
+    // relaxed, see GetPageInfo
+    // registering a superblock writes every one of its pages, a seq_cst
+    //  store would be a full barrier (xchg on x86) for each
     size_t key = AddrToKey(ptr);
-    _pagemap[key].store(info);
+    _pagemap[key].store(info, MO_RELAXED);
+    Touch(key);
+}
+
+inline void PageMap::Touch(size_t key)
+{
+    // only the first write to a pagemap page does an atomic rmw
+    // accounting only, relaxed
+    size_t page = (key * sizeof(PageInfo)) >> LG_PAGE;
+    uint64_t bit = 1ULL << (page % 64);
+    std::atomic<uint64_t>& word = _touched[page / 64];
+    if (LIKELY(word.load(MO_RELAXED) & bit))
+        return;
+
+    if (!(word.fetch_or(bit, MO_RELAXED) & bit))
+        _touchedPages.fetch_add(1, MO_RELAXED);
+}
+
+inline size_t PageMap::GetTouchedBytes() const
+{
+    return _touchedPages.load(MO_RELAXED) * PAGE;
 }
 
 extern PageMap sPageMap;
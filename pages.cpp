@@ -1,20 +1,183 @@
 
 #include <sys/mman.h>
 #include <errno.h>
+#include <atomic>
 
 #include "pages.h"
 #include "log.h"
 
+// free range of chunk pages, stored in the range itself
+struct FreeRange
+{
+    FreeRange* next;
+};
+
+// used with double-cas for atomic ops
+struct FreeRangeNode
+{
+    // ptr
+    FreeRange* range;
+    // aba counter
+    uint64_t counter;
+};
+
+// lock-free stack of free ranges with the same size
+struct FreeRangeList
+{
+    // 0 if list is unused
+    std::atomic<size_t> size;
+    std::atomic<FreeRangeNode> head;
+};
+
+// unused part of current chunk
+struct ChunkCursor
+{
+    char* ptr;
+    char* end;
+};
+
+static std::atomic<ChunkCursor> Cursor({ nullptr, nullptr });
+std::atomic<size_t> PagesMapped({ 0 });
+std::atomic<size_t> PagesReleased({ 0 });
+std::atomic<size_t> PagesMetadata({ 0 });
+static FreeRangeList FreeRanges[CHUNK_FREE_LISTS];
+
+// returns free list for ranges of size bytes
+// if create is true, an unused list is claimed for size if needed
+// returns nullptr if there's no list for size
+static FreeRangeList* GetFreeList(size_t size, bool create)
+{
+    size_t idx = (size >> LG_PAGE) % CHUNK_FREE_LISTS;
+    for (size_t probe = 0; probe < CHUNK_FREE_LISTS; ++probe)
+    {
+        FreeRangeList* list = &FreeRanges[(idx + probe) % CHUNK_FREE_LISTS];
+        size_t listSize = list->size.load();
+        if (listSize == 0 && create)
+        {
+            // try to claim list, might race with another size
+            if (list->size.compare_exchange_strong(listSize, size))
+                return list;
+        }
+
+        if (listSize == size)
+            return list;
+
+        if (listSize == 0)
+            return nullptr;
+    }
+
+    return nullptr;
+}
+
+static void* FreeListPop(FreeRangeList* list)
+{
+    FreeRangeNode oldHead = list->head.load();
+    FreeRangeNode newHead;
+    do
+    {
+        if (!oldHead.range)
+            return nullptr;
+
+        // range may have been concurrently popped and reused, in which
+        //  case next is garbage but the CAS fails due to the counter
+        newHead.range = oldHead.range->next;
+        newHead.counter = oldHead.counter + 1;
+    }
+    while (!list->head.compare_exchange_weak(oldHead, newHead));
+
+    // range was zero'd by madvise except for the link
+    oldHead.range->next = nullptr;
+    return oldHead.range;
+}
+
+static void FreeListPush(FreeRangeList* list, void* ptr)
+{
+    FreeRange* range = (FreeRange*)ptr;
+    FreeRangeNode oldHead = list->head.load();
+    FreeRangeNode newHead;
+    do
+    {
+        range->next = oldHead.range;
+        newHead.range = range;
+        newHead.counter = oldHead.counter + 1;
+    }
+    while (!list->head.compare_exchange_weak(oldHead, newHead));
+}
+
+// unused remainder [ptr, end) of an exhausted chunk, never touched
+// reused if there's already a free list for its size, unmapped otherwise
+//  (claiming a list for an odd size would take one from PageFree)
+static void ChunkTailFree(char* ptr, char* end)
+{
+    size_t size = end - ptr;
+    if (!ptr || size == 0)
+        return;
+
+    if (FreeRangeList* list = GetFreeList(size, false))
+    {
+        FreeListPush(list, ptr);
+        return;
+    }
+
+    PagesReleased.fetch_sub(size);
+    PageFreeDirect(ptr, size);
+}
+
+// bump allocation from current chunk
+static void* ChunkAlloc(size_t size)
+{
+    ChunkCursor oldCursor = Cursor.load();
+    while (true)
+    {
+        if (oldCursor.ptr && oldCursor.ptr + size <= oldCursor.end)
+        {
+            ChunkCursor newCursor = { oldCursor.ptr + size, oldCursor.end };
+            if (Cursor.compare_exchange_weak(oldCursor, newCursor))
+            {
+                PagesReleased.fetch_sub(size);
+                return oldCursor.ptr;
+            }
+
+            continue;
+        }
+
+        // current chunk exhausted, map a new one
+        char* chunk = (char*)PageAllocDirect(CHUNK_SZ);
+        if (UNLIKELY(!chunk))
+            return nullptr;
+
+        ChunkCursor newCursor = { chunk + size, chunk + CHUNK_SZ };
+        if (Cursor.compare_exchange_strong(oldCursor, newCursor))
+        {
+            // unused part of the chunk is never touched
+            PagesReleased.fetch_add(CHUNK_SZ - size);
+            // nobody else can get the remainder of the old chunk anymore
+            ChunkTailFree(oldCursor.ptr, oldCursor.end);
+            return chunk;
+        }
+
+        // another thread installed a new chunk, use it instead
+        PageFreeDirect(chunk, CHUNK_SZ);
+    }
+}
+
 void* PageAlloc(size_t size)
 {
     ASSERT((size & PAGE_MASK) == 0);
 
-    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
-           MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (ptr == MAP_FAILED)
-        ptr = nullptr;
- 
-    return ptr;
+    if (UNLIKELY(size > CHUNK_MAX_ALLOC))
+        return PageAllocDirect(size);
+
+    if (FreeRangeList* list = GetFreeList(size, false))
+    {
+        if (void* ptr = FreeListPop(list))
+        {
+            PagesReleased.fetch_sub(size);
+            return ptr;
+        }
+    }
+
+    return ChunkAlloc(size);
 }
 
 void* PageAllocOvercommit(size_t size)
@@ -34,10 +197,68 @@ void PageFree(void* ptr, size_t size)
 {
     ASSERT((size & PAGE_MASK) == 0);
 
+    if (UNLIKELY(size > CHUNK_MAX_ALLOC))
+    {
+        PageFreeDirect(ptr, size);
+        return;
+    }
+
+    // if there are too many distinct sizes, the range is unmapped, which
+    //  splits the chunk's mapping but keeps address space bounded
+    FreeRangeList* list = GetFreeList(size, true);
+    if (UNLIKELY(!list))
+    {
+        PageFreeDirect(ptr, size);
+        return;
+    }
+
+    // release physical memory, unlike munmap this doesn't split the
+    //  chunk's mapping
+    int ret = madvise(ptr, size, MADV_DONTNEED);
+    (void)ret; // suppress unused variable warning
+    ASSERT(ret == 0);
+
+    PagesReleased.fetch_add(size);
+    FreeListPush(list, ptr);
+}
+
+void* PageAllocDirect(size_t size)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+
+    void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (ptr == MAP_FAILED)
+        return nullptr;
+
+    PagesMapped.fetch_add(size);
+    return ptr;
+}
+
+void PageFreeDirect(void* ptr, size_t size)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+
     int ret = munmap(ptr, size);
     (void)ret; // suppress unused variable warning
     int err = errno;
     (void)err;
     ASSERT(ret == 0);
+
+    PagesMapped.fetch_sub(size);
 }
 
+void* PageRealloc(void* ptr, size_t oldSize, size_t newSize)
+{
+    ASSERT((oldSize & PAGE_MASK) == 0);
+    ASSERT((newSize & PAGE_MASK) == 0);
+
+    // remaps page tables instead of copying page contents
+    void* newPtr = mremap(ptr, oldSize, newSize, MREMAP_MAYMOVE);
+    if (newPtr == MAP_FAILED)
+        return nullptr;
+
+    PagesMapped.fetch_add(newSize);
+    PagesMapped.fetch_sub(oldSize);
+    return newPtr;
+}
@@ -3,18 +3,51 @@
 #define __PAGES_H
 
 #include <cinttypes>
+#include <atomic>
 #include "defines.h"
 
 // return page address for page containing a
 #define PAGE_ADDR2BASE(a) \
-    ((void*)((uintptr)(a) & ~PAGE_MASK))
+    ((void*)((uintptr_t)(a) & ~PAGE_MASK))
+
+// pages are carved from chunks, large regions mapped from the OS at once
+//  so that the process doesn't accumulate a mapping (VMA) per superblock
+// 64MB chunks
+#define CHUNK_SZ (32 * HUGEPAGE)
+// larger requests get a dedicated mapping
+#define CHUNK_MAX_ALLOC (CHUNK_SZ / 4)
+// freed pages are kept in free lists by size, for reuse
+// max number of distinct sizes, ranges of other sizes are unmapped
+#define CHUNK_FREE_LISTS 128
+
+// memory accounting, see lr_memory_stats
+// bytes mapped from the OS, excluding overcommitted reservations
+extern std::atomic<size_t> PagesMapped;
+// mapped bytes without physical memory: chunk pages that were given
+//  back with madvise, or never used
+extern std::atomic<size_t> PagesReleased;
+// mapped bytes used for allocator metadata, updated by the users
+//  of PageAlloc (descriptor blocks, run superblock headers, arenas, ...)
+extern std::atomic<size_t> PagesMetadata;
 
 // returns a set of continous pages, totaling to size bytes
+// pages are zero'd
 void* PageAlloc(size_t size);
 // explictely allow overcommiting
 // used for array-based page map
 void* PageAllocOvercommit(size_t size);
 // free a set of continous pages, totaling to size bytes
+// physical memory is given back to the OS, but the address range is
+//  kept for reuse by PageAlloc (unmapped if there's no free list left
+//  for size)
 void PageFree(void* ptr, size_t size);
+// dedicated mapping, can be resized with PageRealloc
+// used for large allocations
+void* PageAllocDirect(size_t size);
+void PageFreeDirect(void* ptr, size_t size);
+// resize a dedicated mapping from oldSize to newSize bytes,
+//  without copying, pages might be moved
+// returns nullptr on failure, in which case ptr is left untouched
+void* PageRealloc(void* ptr, size_t oldSize, size_t newSize);
 
 #endif // __PAGES_H
@@ -0,0 +1,81 @@
+
+#ifndef __PROBES_H
+#define __PROBES_H
+
+#include <cinttypes>
+
+// USDT static tracepoints on allocator slow paths, provider "lrmichael"
+// a probe is a single nop until a tracer attaches to it, e.g
+//  bpftrace -e 'usdt:./lrmichael.so:lrmichael:sb_alloc { @[arg2] = count(); }'
+// probes:
+//  sb_alloc(desc, superblock, blockSize)   new superblock
+//  sb_free(desc, superblock, sbSize)       superblock released
+//  desc_alloc(desc)                        descriptor taken from free list
+//  desc_block_alloc(ptr, size)             new block of descriptors
+//  large_alloc(ptr, size)                  large/medium allocation
+//  large_free(ptr, size)
+//  partial_push(heap, desc)                partial list push/pop
+//  partial_pop(heap, desc)
+
+// if 0, probes are compiled out
+#ifndef LFMALLOC_PROBES
+#define LFMALLOC_PROBES 1
+#endif
+
+#if LFMALLOC_PROBES && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+#if !LFMALLOC_PROBES
+#define LR_PROBE1(name, a)
+#define LR_PROBE2(name, a, b)
+#define LR_PROBE3(name, a, b, c)
+
+#elif defined(DTRACE_PROBE3)
+#define LR_PROBE1(name, a) DTRACE_PROBE1(lrmichael, name, a)
+#define LR_PROBE2(name, a, b) DTRACE_PROBE2(lrmichael, name, a, b)
+#define LR_PROBE3(name, a, b, c) DTRACE_PROBE3(lrmichael, name, a, b, c)
+
+#else
+// sys/sdt.h is missing, emit the same .note.stapsdt entries
+// (version 3 notes, x86-64, all arguments passed as 8 byte values)
+#define LR_SDT_PROBE(provider, name, args, ...) \
+    __asm__ __volatile__ ( \
+        "990: nop\n" \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+        ".balign 4\n" \
+        ".4byte 992f-991f, 994f-993f, 3\n" \
+        "991: .asciz \"stapsdt\"\n" \
+        "992: .balign 4\n" \
+        "993: .8byte 990b\n" \
+        ".8byte _.stapsdt.base\n" \
+        ".8byte 0\n" \
+        ".asciz \"" #provider "\"\n" \
+        ".asciz \"" #name "\"\n" \
+        ".asciz \"" args "\"\n" \
+        "994: .balign 4\n" \
+        ".popsection\n" \
+        ".ifndef _.stapsdt.base\n" \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+        ".weak _.stapsdt.base\n" \
+        ".hidden _.stapsdt.base\n" \
+        "_.stapsdt.base: .space 1\n" \
+        ".size _.stapsdt.base, 1\n" \
+        ".popsection\n" \
+        ".endif\n" \
+        :: __VA_ARGS__)
+
+#define LR_PROBE1(name, a) \
+    LR_SDT_PROBE(lrmichael, name, "8@%0", "nor"((uint64_t)(a)))
+#define LR_PROBE2(name, a, b) \
+    LR_SDT_PROBE(lrmichael, name, "8@%0 8@%1", \
+        "nor"((uint64_t)(a)), "nor"((uint64_t)(b)))
+#define LR_PROBE3(name, a, b, c) \
+    LR_SDT_PROBE(lrmichael, name, "8@%0 8@%1 8@%2", \
+        "nor"((uint64_t)(a)), "nor"((uint64_t)(b)), "nor"((uint64_t)(c)))
+
+#endif
+
+#endif // __PROBES_H
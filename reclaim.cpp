@@ -0,0 +1,160 @@
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <atomic>
+
+#include "reclaim.h"
+#include "log.h"
+
+#if LFMALLOC_RECLAIMER
+
+// pending ranges, lock-free stack
+// producers push, the consumer takes the whole stack at once, so no
+//  node is ever popped individually and there's no ABA problem
+static std::atomic<ReclaimNode*> ReclaimQueue({ nullptr });
+
+enum ReclaimerState
+{
+    RECLAIMER_STOPPED   = 0,
+    RECLAIMER_RUNNING   = 1,
+    // thread couldn't be created, ranges are released synchronously
+    RECLAIMER_FAILED    = 2,
+};
+
+static std::atomic<int> ReclaimerStatus({ RECLAIMER_STOPPED });
+static pthread_once_t ReclaimOnce = PTHREAD_ONCE_INIT;
+
+static void ReleaseRange(ReclaimNode* node)
+{
+    // node is overwritten by PageFree
+    void* ptr = node;
+    size_t size = node->size;
+    if (node->run)
+        RunReleasePages(node->run, ptr, size);
+    else if (node->direct)
+        PageFreeDirect(ptr, size);
+    else
+        PageFree(ptr, size);
+}
+
+// releases all ranges currently queued
+// returns false if queue was empty
+static bool ReclaimAll()
+{
+    ReclaimNode* node = ReclaimQueue.exchange(nullptr);
+    if (!node)
+        return false;
+
+    while (node)
+    {
+        ReclaimNode* next = node->next;
+        ReleaseRange(node);
+        node = next;
+    }
+
+    return true;
+}
+
+static void* ReclaimerMain(void*)
+{
+    uint64_t sleepUs = RECLAIM_SLEEP_MIN;
+    while (true)
+    {
+        if (ReclaimAll())
+            sleepUs = RECLAIM_SLEEP_MIN;
+        else if (sleepUs < RECLAIM_SLEEP_MAX)
+            sleepUs *= 2;
+
+        struct timespec ts;
+        ts.tv_sec = sleepUs / 1000000;
+        ts.tv_nsec = (sleepUs % 1000000) * 1000;
+        nanosleep(&ts, nullptr);
+    }
+
+    return nullptr;
+}
+
+// fork only duplicates the calling thread, child has to restart it
+// ranges still queued are released by the new thread, ranges the old
+//  thread was releasing during fork are leaked in the child
+static void ReclaimAtForkChild()
+{
+    int status = ReclaimerStatus.load();
+    if (status == RECLAIMER_RUNNING)
+        ReclaimerStatus.store(RECLAIMER_STOPPED);
+}
+
+static void ReclaimRegisterFork()
+{
+    pthread_atfork(nullptr, nullptr, ReclaimAtForkChild);
+}
+
+static void ReclaimerStart()
+{
+    int expected = RECLAIMER_STOPPED;
+    if (!ReclaimerStatus.compare_exchange_strong(expected, RECLAIMER_RUNNING))
+        return;
+
+    pthread_once(&ReclaimOnce, ReclaimRegisterFork);
+
+    // signals are handled by application threads
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    // only needs a small stack
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, &attr, ReclaimerMain, nullptr);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    if (ret != 0)
+    {
+        ReclaimerStatus.store(RECLAIMER_FAILED);
+        ReclaimAll();
+    }
+}
+
+static void ReclaimPush(void* ptr, size_t size, bool direct,
+        RunSuperblock* run)
+{
+    ASSERT(size >= sizeof(ReclaimNode));
+
+    ReclaimNode* node = (ReclaimNode*)ptr;
+    node->size = size;
+    node->direct = direct;
+    node->run = run;
+
+    if (UNLIKELY(ReclaimerStatus.load() != RECLAIMER_RUNNING))
+    {
+        ReclaimerStart();
+        if (ReclaimerStatus.load() == RECLAIMER_FAILED)
+        {
+            ReleaseRange(node);
+            return;
+        }
+    }
+
+    ReclaimNode* oldHead = ReclaimQueue.load();
+    do
+        node->next = oldHead;
+    while (!ReclaimQueue.compare_exchange_weak(oldHead, node));
+}
+
+void ReclaimPages(void* ptr, size_t size, bool direct)
+{
+    ReclaimPush(ptr, size, direct, nullptr);
+}
+
+void ReclaimRunPages(RunSuperblock* run, void* ptr, size_t size)
+{
+    ReclaimPush(ptr, size, false, run);
+}
+
+#endif // LFMALLOC_RECLAIMER
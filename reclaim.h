@@ -0,0 +1,81 @@
+
+#ifndef __RECLAIM_H
+#define __RECLAIM_H
+
+#include <cstddef>
+
+#include "pages.h"
+#include "runs.h"
+
+// if 1, pages given back to the OS (empty superblocks the pool doesn't
+//  keep, large allocations, free pages of run superblocks) are handed to
+//  a background reclaimer thread,
+//  which does the madvise/munmap, so free never makes a syscall
+//  (except for starting the thread, on first use)
+// opt-in, build with make CPPFLAGS=-DLFMALLOC_RECLAIMER=1
+#ifndef LFMALLOC_RECLAIMER
+#define LFMALLOC_RECLAIMER 0
+#endif
+
+// reclaimer polls its queue, sleeping between polls
+// interval starts at RECLAIM_SLEEP_MIN and doubles while the queue
+//  stays empty, up to RECLAIM_SLEEP_MAX (in microseconds)
+#ifndef RECLAIM_SLEEP_MIN
+#define RECLAIM_SLEEP_MIN 1000
+#endif
+#ifndef RECLAIM_SLEEP_MAX
+#define RECLAIM_SLEEP_MAX 100000
+#endif
+
+// pending range, stored in the range itself
+struct ReclaimNode
+{
+    ReclaimNode* next;
+    size_t size;
+    // true if range is a dedicated mapping (PageFreeDirect)
+    bool direct;
+    // run superblock, if range is free pages of one (RunReleasePages)
+    RunSuperblock* run;
+};
+
+#if LFMALLOC_RECLAIMER
+// queue range for PageFree/PageFreeDirect by the reclaimer thread
+// range must be at least sizeof(ReclaimNode) bytes, and is overwritten
+// falls back to releasing the range immediately if the thread
+//  couldn't be started
+void ReclaimPages(void* ptr, size_t size, bool direct);
+// queue free pages of run for RunReleasePages by the reclaimer thread
+void ReclaimRunPages(RunSuperblock* run, void* ptr, size_t size);
+
+inline void ReleasePages(void* ptr, size_t size)
+{
+    ReclaimPages(ptr, size, false);
+}
+
+inline void ReleasePagesDirect(void* ptr, size_t size)
+{
+    ReclaimPages(ptr, size, true);
+}
+
+inline void ReleaseRunPages(RunSuperblock* run, void* ptr, size_t size)
+{
+    ReclaimRunPages(run, ptr, size);
+}
+#else
+inline void ReleasePages(void* ptr, size_t size)
+{
+    PageFree(ptr, size);
+}
+
+inline void ReleasePagesDirect(void* ptr, size_t size)
+{
+    PageFreeDirect(ptr, size);
+}
+
+inline void ReleaseRunPages(RunSuperblock* run, void* ptr, size_t size)
+{
+    RunReleasePages(run, ptr, size);
+}
+#endif // LFMALLOC_RECLAIMER
+
+#endif // __RECLAIM_H
@@ -0,0 +1,318 @@
+
+#include <algorithm>
+
+#include <sys/mman.h>
+
+#include "runs.h"
+#include "pages.h"
+#include "reclaim.h"
+#include "log.h"
+
+// head of run superblock list
+static std::atomic<RunSuperblock*> RunSuperblocks({ nullptr });
+
+static void RunLock(RunSuperblock* run)
+{
+    while (run->lock.test_and_set(std::memory_order_acquire))
+        __builtin_ia32_pause();
+}
+
+static void RunUnlock(RunSuperblock* run)
+{
+    run->lock.clear(std::memory_order_release);
+}
+
+// set (or clear) bits [page, page + npages) of bitmap
+// returns number of bits that changed
+static size_t BitmapMark(uint64_t* bitmap, size_t page, size_t npages,
+        bool set)
+{
+    size_t changed = 0;
+    for (size_t idx = page; idx < page + npages; ++idx)
+    {
+        uint64_t bit = 1ULL << (idx % BITMAP_WORD_BITS);
+        uint64_t& word = bitmap[idx / BITMAP_WORD_BITS];
+        changed += ((word & bit) != 0) != set;
+        if (set)
+            word |= bit;
+        else
+            word &= ~bit;
+    }
+
+    return changed;
+}
+
+static bool BitmapTest(uint64_t const* bitmap, size_t idx)
+{
+    return bitmap[idx / BITMAP_WORD_BITS] & (1ULL << (idx % BITMAP_WORD_BITS));
+}
+
+// marks pages [page, page + npages) used (or free)
+// pages that were released get physical memory again when used, pages
+//  that are freed are dirty until released
+static void RunMark(RunSuperblock* run, size_t page, size_t npages, bool used)
+{
+    BitmapMark(run->used, page, npages, used);
+    if (used)
+    {
+        size_t released = BitmapMark(run->released, page, npages, false);
+        if (released)
+            PagesReleased.fetch_sub(released * PAGE);
+
+        run->dirtyPages -= npages - released;
+    }
+    else
+        run->dirtyPages += npages;
+}
+
+// free range of pages being given back to the OS
+struct RunRange
+{
+    size_t page;
+    size_t npages;
+};
+
+// if run superblock has more than RUN_DIRTY_MAX dirty pages, marks free
+//  and dirty ranges used until RUN_DIRTY_MAX / 2 are left (none if it's
+//  empty), so that they are pending until RunReleasePages gives them back
+//  to the OS, without holding lock
+// at most RUN_RELEASE_RANGES ranges, a later free releases the rest
+// must be called while holding lock
+// returns number of ranges
+static size_t RunReleaseBegin(RunSuperblock* run, RunRange* ranges)
+{
+    size_t keep = RUN_DIRTY_MAX / 2;
+    if (run->freePages.load() == RUN_SB_PAGES)
+        keep = 0;
+    else if (run->dirtyPages <= RUN_DIRTY_MAX)
+        return 0;
+
+    size_t count = 0;
+    size_t page = 0;
+    size_t dirty = run->dirtyPages;
+    while (page < RUN_SB_PAGES && count < RUN_RELEASE_RANGES && dirty > keep)
+    {
+        if (BitmapTest(run->used, page) || BitmapTest(run->released, page))
+        {
+            ++page;
+            continue;
+        }
+
+        size_t first = page;
+        while (page < RUN_SB_PAGES && !BitmapTest(run->used, page) &&
+                !BitmapTest(run->released, page))
+            ++page;
+
+        ranges[count++] = { first, page - first };
+        dirty -= page - first;
+    }
+
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        BitmapMark(run->used, ranges[idx].page, ranges[idx].npages, true);
+        run->freePages.fetch_sub(ranges[idx].npages);
+        run->dirtyPages -= ranges[idx].npages;
+    }
+
+    return count;
+}
+
+// hands ranges marked by RunReleaseBegin to RunReleasePages, through
+//  the reclaimer if enabled
+// must be called without holding lock
+static void RunRelease(RunSuperblock* run, RunRange const* ranges,
+        size_t count)
+{
+    for (size_t idx = 0; idx < count; ++idx)
+    {
+        char* ptr = run->base + ranges[idx].page * PAGE;
+        ReleaseRunPages(run, ptr, ranges[idx].npages * PAGE);
+    }
+}
+
+void RunReleasePages(RunSuperblock* run, void* ptr, size_t size)
+{
+    madvise(ptr, size, MADV_DONTNEED);
+
+    size_t page = ((char*)ptr - run->base) / PAGE;
+    size_t npages = size / PAGE;
+    RunLock(run);
+    BitmapMark(run->released, page, npages, true);
+    BitmapMark(run->used, page, npages, false);
+    run->freePages.fetch_add(npages);
+    PagesReleased.fetch_add(size);
+    RunUnlock(run);
+}
+
+// returns true if pages [page, page + npages) are free
+static bool RunIsFree(RunSuperblock const* run, size_t page, size_t npages)
+{
+    for (size_t idx = page; idx < page + npages; ++idx)
+    {
+        uint64_t bit = 1ULL << (idx % BITMAP_WORD_BITS);
+        if (run->used[idx / BITMAP_WORD_BITS] & bit)
+            return false;
+    }
+
+    return true;
+}
+
+// first fit search for npages free pages
+// returns index of first page, or RUN_SB_PAGES if none was found
+static size_t RunFind(RunSuperblock const* run, size_t npages)
+{
+    size_t runStart = 0;
+    size_t runLen = 0;
+    size_t page = 0;
+    while (page < RUN_SB_PAGES)
+    {
+        size_t shift = page % BITMAP_WORD_BITS;
+        size_t wordLeft = BITMAP_WORD_BITS - shift;
+        uint64_t word = run->used[page / BITMAP_WORD_BITS] >> shift;
+        if (word & 1)
+        {
+            // skip used pages
+            size_t n = std::min<size_t>(__builtin_ctzll(~word), wordLeft);
+            page += n;
+            runStart = page;
+            runLen = 0;
+        }
+        else
+        {
+            size_t n = word ? __builtin_ctzll(word) : wordLeft;
+            n = std::min(n, wordLeft);
+            page += n;
+            runLen += n;
+            if (runLen >= npages)
+                return runStart;
+        }
+    }
+
+    return RUN_SB_PAGES;
+}
+
+static void* RunSuperblockAlloc(RunSuperblock* run, size_t npages)
+{
+    void* ptr = nullptr;
+    RunLock(run);
+    if (run->freePages.load() >= npages)
+    {
+        size_t page = RunFind(run, npages);
+        if (page != RUN_SB_PAGES)
+        {
+            RunMark(run, page, npages, true);
+            run->freePages.fetch_sub(npages);
+            ptr = run->base + page * PAGE;
+        }
+    }
+
+    RunUnlock(run);
+    return ptr;
+}
+
+void* RunAlloc(size_t size, RunSuperblock** run)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+    ASSERT(size <= MAX_RUN_SZ);
+
+    size_t npages = size / PAGE;
+    for (RunSuperblock* curr = RunSuperblocks.load(); curr; curr = curr->next)
+    {
+        if (curr->freePages.load() < npages)
+            continue;
+
+        if (void* ptr = RunSuperblockAlloc(curr, npages))
+        {
+            *run = curr;
+            return ptr;
+        }
+    }
+
+    // no run superblock has enough contiguous free pages, map a new one
+    // pages given by the OS are zero'd, so bitmap starts empty
+    // untouched pages have no physical memory, so they start released
+    char* mem = (char*)PageAlloc(RUN_META_SZ + RUN_SB_SZ);
+    if (UNLIKELY(!mem))
+        return nullptr;
+
+    PagesMetadata.fetch_add(RUN_META_SZ);
+
+    RunSuperblock* newRun = (RunSuperblock*)mem;
+    newRun->lock.clear();
+    newRun->freePages.store(RUN_SB_PAGES - npages);
+    newRun->base = mem + RUN_META_SZ;
+    BitmapMark(newRun->released, 0, RUN_SB_PAGES, true);
+    PagesReleased.fetch_add(RUN_SB_SZ);
+    RunMark(newRun, 0, npages, true);
+
+    // publish superblock, no pops so no ABA
+    RunSuperblock* oldHead = RunSuperblocks.load();
+    do
+    {
+        newRun->next = oldHead;
+    }
+    while (!RunSuperblocks.compare_exchange_weak(oldHead, newRun));
+
+    *run = newRun;
+    return newRun->base;
+}
+
+void RunFree(RunSuperblock* run, void* ptr, size_t size)
+{
+    ASSERT((size & PAGE_MASK) == 0);
+    ASSERT((char*)ptr >= run->base);
+    ASSERT((char*)ptr + size <= run->base + RUN_SB_SZ);
+
+    size_t page = ((char*)ptr - run->base) / PAGE;
+    size_t npages = size / PAGE;
+
+    RunRange ranges[RUN_RELEASE_RANGES];
+    RunLock(run);
+    RunMark(run, page, npages, false);
+    run->freePages.fetch_add(npages);
+    size_t count = RunReleaseBegin(run, ranges);
+    RunUnlock(run);
+
+    RunRelease(run, ranges, count);
+}
+
+bool RunResize(RunSuperblock* run, void* ptr, size_t oldSize, size_t newSize)
+{
+    ASSERT((oldSize & PAGE_MASK) == 0);
+    ASSERT((newSize & PAGE_MASK) == 0);
+    ASSERT(newSize <= MAX_RUN_SZ);
+
+    size_t page = ((char*)ptr - run->base) / PAGE;
+    size_t oldPages = oldSize / PAGE;
+    size_t newPages = newSize / PAGE;
+
+    bool ret = true;
+    RunRange ranges[RUN_RELEASE_RANGES];
+    size_t count = 0;
+    RunLock(run);
+    if (newPages < oldPages)
+    {
+        // release tail of run
+        RunMark(run, page + newPages, oldPages - newPages, false);
+        run->freePages.fetch_add(oldPages - newPages);
+        count = RunReleaseBegin(run, ranges);
+    }
+    else if (newPages > oldPages)
+    {
+        size_t extra = newPages - oldPages;
+        // extend into following free pages
+        if (page + newPages <= RUN_SB_PAGES &&
+            RunIsFree(run, page + oldPages, extra))
+        {
+            RunMark(run, page + oldPages, extra, true);
+            run->freePages.fetch_sub(extra);
+        }
+        else
+            ret = false;
+    }
+
+    RunUnlock(run);
+
+    RunRelease(run, ranges, count);
+    return ret;
+}
@@ -0,0 +1,73 @@
+
+#ifndef __RUNS_H
+#define __RUNS_H
+
+#include <atomic>
+
+#include "defines.h"
+
+// page run allocator
+// medium allocations (too large for a size class, up to MAX_RUN_SZ) are
+//  contiguous page runs carved from shared run superblocks, instead of
+//  each getting a dedicated mapping (and VMA) from the OS
+// run superblocks are never unmapped (their list is push-only), but once
+//  one has more than RUN_DIRTY_MAX free pages with physical memory, they
+//  are given back to the OS with madvise, so that churn doesn't keep
+//  peak memory resident
+
+// run superblocks are 8MB
+#define RUN_SB_SZ (4 * HUGEPAGE)
+#define RUN_SB_PAGES (RUN_SB_SZ / PAGE)
+// largest run, 1MB
+#define MAX_RUN_SZ (256 * PAGE)
+// free pages with physical memory a run superblock keeps for reuse, 4MB
+//  (all of them are released once it's empty)
+// releasing them one run at a time would make churn fault pages in over
+//  and over
+#define RUN_DIRTY_MAX (RUN_SB_PAGES / 2)
+// max number of free ranges given back to the OS at once, the rest is
+//  released by a later free
+#define RUN_RELEASE_RANGES 64
+
+#define LG_BITMAP_WORD 6
+#define BITMAP_WORD_BITS (1ULL << LG_BITMAP_WORD)
+
+struct RunSuperblock
+{
+    // protects used bitmap, one lock per run superblock
+    std::atomic_flag lock;
+    // number of free pages
+    // only updated while holding lock, used as a hint without it
+    std::atomic<uint64_t> freePages;
+    // number of free pages that weren't given back to the OS
+    // only accessed while holding lock
+    uint64_t dirtyPages;
+    // first page of superblock
+    char* base;
+    // list of all run superblocks, push-only
+    RunSuperblock* next;
+    // bit set if page is part of an allocated run
+    // free runs are implicitly coalesced with their free neighbours
+    uint64_t used[RUN_SB_PAGES / BITMAP_WORD_BITS];
+    // bit set if page is free and has no physical memory (never used, or
+    //  given back to the OS), counted in PagesReleased
+    uint64_t released[RUN_SB_PAGES / BITMAP_WORD_BITS];
+};
+
+// metadata is kept in its own page(s), at the start of the mapping
+#define RUN_META_SZ PAGE_CEILING(sizeof(RunSuperblock))
+
+// returns a run of size bytes (a page multiple <= MAX_RUN_SZ)
+// *run is set to the run superblock the run was carved from
+void* RunAlloc(size_t size, RunSuperblock** run);
+// returns a run of size bytes to its run superblock
+void RunFree(RunSuperblock* run, void* ptr, size_t size);
+// gives a range pending release back to the OS and frees it, called by
+//  the freeing thread, or the reclaimer (see reclaim.h)
+void RunReleasePages(RunSuperblock* run, void* ptr, size_t size);
+// resizes run from oldSize to newSize bytes without moving it
+// shrinking always succeeds, growing needs the following pages to be free
+// returns false if run couldn't be resized
+bool RunResize(RunSuperblock* run, void* ptr, size_t oldSize, size_t newSize);
+
+#endif // __RUNS_H
@@ -0,0 +1,50 @@
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "single_thread.h"
+#include "lrmichael.h"
+#include "log.h"
+
+#if LFMALLOC_SINGLE_THREAD
+
+bool MultiThreaded = false;
+
+typedef int (*PthreadCreateFn)(pthread_t*, pthread_attr_t const*,
+        void* (*)(void*), void*);
+
+static std::atomic<PthreadCreateFn> RealPthreadCreate({ nullptr });
+
+// interposes libc's pthread_create (with LD_PRELOAD, or when linked
+//  statically into the application)
+// the switch to atomics is safe because it's made by the only thread,
+//  before the second one exists: pthread_create synchronizes with the
+//  start of the new thread, so it sees every plain store made so far
+//  and MultiThreaded set, and the creating thread sees its own store
+extern "C"
+LFMALLOC_EXPORT
+int pthread_create(pthread_t* thread, pthread_attr_t const* attr,
+        void* (*start)(void*), void* arg)
+{
+    MultiThreaded = true;
+
+    PthreadCreateFn create = RealPthreadCreate.load(
+            std::memory_order_relaxed);
+    if (UNLIKELY(!create))
+    {
+        create = (PthreadCreateFn)dlsym(RTLD_NEXT, "pthread_create");
+        if (!create)
+        {
+            LOG_ERR("can't find pthread_create: %s", dlerror());
+            return EAGAIN;
+        }
+
+        RealPthreadCreate.store(create, std::memory_order_relaxed);
+    }
+
+    return create(thread, attr, start, arg);
+}
+
+#endif // LFMALLOC_SINGLE_THREAD
@@ -0,0 +1,128 @@
+
+#ifndef __SINGLE_THREAD_H
+#define __SINGLE_THREAD_H
+
+#include <atomic>
+#include <cstring>
+
+#include "defines.h"
+
+// if 1, read-modify-writes of the lock-free core (CAS loops, counters)
+//  are done with plain loads and stores while the process has a single
+//  thread, so single threaded programs don't pay for lock prefixed
+//  instructions
+// the second thread is detected by interposing pthread_create, which
+//  switches to atomics for good before creating it (see single_thread.cpp)
+// opt-in, build with make CPPFLAGS=-DLFMALLOC_SINGLE_THREAD=1
+// caveats, threads that aren't created through pthread_create aren't
+//  seen, so it must not be used if any of these allocate:
+// - threads created by glibc internally (timer_create with SIGEV_THREAD,
+//  getaddrinfo_a, aio, mq_notify), or with C11 thrd_create
+// - threads created with clone() directly
+// - signal handlers interrupting an allocation while single threaded
+//  (a plain read-modify-write isn't atomic with respect to them)
+#ifndef LFMALLOC_SINGLE_THREAD
+#define LFMALLOC_SINGLE_THREAD 0
+#endif
+
+#if LFMALLOC_SINGLE_THREAD
+// set by pthread_create, never reset
+extern bool MultiThreaded;
+#define SINGLE_THREADED() (!MultiThreaded)
+#else
+#define SINGLE_THREADED() false
+#endif
+
+// std::atomic<T> has the layout of T, so while single threaded it's
+//  accessed as a T
+// (16 byte atomics, e.g DescriptorNode, are libatomic calls otherwise)
+template<class T>
+inline T* PlainPtr(std::atomic<T>& obj)
+{
+    return reinterpret_cast<T*>(&obj);
+}
+
+template<class T>
+inline bool CasPlain(std::atomic<T>& obj, T& expected, T desired)
+{
+    T* plain = PlainPtr(obj);
+    if (memcmp(plain, &expected, sizeof(T)) != 0)
+    {
+        expected = *plain;
+        return false;
+    }
+
+    *plain = desired;
+    return true;
+}
+
+// U is deduced separately, so that e.g nullptr or an int can be passed
+template<class T, class U>
+inline bool CasWeak(std::atomic<T>& obj, T& expected, U desired,
+        std::memory_order success, std::memory_order failure)
+{
+    if (SINGLE_THREADED())
+        return CasPlain<T>(obj, expected, desired);
+
+    return obj.compare_exchange_weak(expected, desired, success, failure);
+}
+
+template<class T, class U>
+inline bool CasStrong(std::atomic<T>& obj, T& expected, U desired,
+        std::memory_order success, std::memory_order failure)
+{
+    if (SINGLE_THREADED())
+        return CasPlain<T>(obj, expected, desired);
+
+    return obj.compare_exchange_strong(expected, desired, success, failure);
+}
+
+template<class T, class U>
+inline T FetchAdd(std::atomic<T>& obj, U value, std::memory_order order)
+{
+    if (SINGLE_THREADED())
+    {
+        T old = *PlainPtr(obj);
+        *PlainPtr(obj) = old + value;
+        return old;
+    }
+
+    return obj.fetch_add(value, order);
+}
+
+template<class T, class U>
+inline T FetchSub(std::atomic<T>& obj, U value, std::memory_order order)
+{
+    if (SINGLE_THREADED())
+    {
+        T old = *PlainPtr(obj);
+        *PlainPtr(obj) = old - value;
+        return old;
+    }
+
+    return obj.fetch_sub(value, order);
+}
+
+// loads/stores of 16 byte list nodes (8 byte ones are plain already)
+template<class T>
+inline T LoadNode(std::atomic<T>& obj, std::memory_order order)
+{
+    if (SINGLE_THREADED())
+        return *PlainPtr(obj);
+
+    return obj.load(order);
+}
+
+template<class T, class U>
+inline void StoreNode(std::atomic<T>& obj, U value, std::memory_order order)
+{
+    if (SINGLE_THREADED())
+    {
+        *PlainPtr(obj) = value;
+        return;
+    }
+
+    obj.store(value, order);
+}
+
+#endif // __SINGLE_THREAD_H